@@ -9,195 +9,960 @@
 #include <errno.h>
 #include <string.h>
 #include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include "d0.h"
+#include "d0priv.h"
+#include "sml.h"
 
 // read timeout in milliseconds
 #define D0_READ_TIMEOUT 2000
+// read timeout for push protocols, the meters send a telegram every few seconds
+// (d0_set_timeout for slower ones)
+#define D0_PUSH_TIMEOUT 10000
+// after data arrived, let the kernel collect more for this many milliseconds before the next
+// read, so we don't wake up for every single byte
+#define D0_HOLDOFF 100
+
+// ack with option select: normal protocol, baud rate, mode (both set in signed_on()).
+// mode is 0 for the data readout, 1 for programming mode
+static const char * PULLSEQ = "\006000";
+// read command of programming mode
+#define D0_READCMD "R5"
+
+// baud rates of protocol mode C, index is the baud rate character '0'..'6'
+static const struct {
+	int baud;
+	speed_t speed;
+} bauds[] = {
+	{ 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 }
+};
+// number of readouts at 300 baud after a failed readout at a higher baud rate
+#define D0_FALLBACK_READS 10
 
 /* helper ***********************************************************/
 
-static void txline(struct pollfd * fds, char * line)
+// send line, returns 0 on errors (errstr is set)
+static int txline(D0 * d0, const char * line)
 {
 	char buf[BUFSIZE];
 
 	int len = snprintf(buf, sizeof(buf), "%s\r\n", line);
 	if (len < 0)
-		return;
-	write(fds->fd, buf, len);
+		return 0;
+	// the port is non-blocking, but a few bytes always fit into the output queue
+	++d0->stats.writes;
+	if (write(d0->_fds.fd, buf, len) != len) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "write error %d: %s", errno, strerror(errno));
+		return 0;
+	}
+	return 1;
 }
 
-static int rxline(struct pollfd * fds, char * buf)
+// send a programming mode command: SOH cmd STX data ETX BCC, without data (break) SOH cmd ETX BCC
+static int txcmd(D0 * d0, const char * cmd, const char * data)
 {
-	int len;
-
-	fds->events = POLLIN;
-	memset(buf, 0, BUFSIZE);
-	for (len=0; len<=BUFSIZE-2;) {
-		int rc = poll(fds, 1, D0_READ_TIMEOUT);
-		if (rc < 0) { // error
-			snprintf(buf, BUFSIZE, "poll error %d: %s", errno, strerror(errno));
-			return -1;
-		}
-		if (rc == 0) { // timeout
-			snprintf(buf, BUFSIZE, "poll timeout");
-			return -1;
-		}
-		ssize_t got = read(fds->fd, buf+len, 1);
-		if (got < 0) { // read error
-			snprintf(buf, BUFSIZE, "read error %d: %s", errno, strerror(errno));
-			return -1;
-		}
-		if (rc == 0) { // device error?
-			snprintf(buf, BUFSIZE, "read nothing");
-			return -1;
-		}
-		len += got;
-		if (buf[len-1] == '\n' || (len > 1 && buf[0] == ETX))
-			break;
+	char buf[BUFSIZE];
+
+	int len = data ? snprintf(buf, sizeof(buf), "%c%s%c%s%c", SOH, cmd, STX, data, ETX) :
+		snprintf(buf, sizeof(buf), "%c%s%c", SOH, cmd, ETX);
+	if (len < 0 || len >= sizeof(buf)-1)
+		return 0;
+	unsigned char bcc = 0;
+	for (int i=1; i<len; ++i)
+		bcc ^= buf[i];
+	buf[len++] = bcc;
+	++d0->stats.writes;
+	if (write(d0->_fds.fd, buf, len) != len) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "write error %d: %s", errno, strerror(errno));
+		return 0;
 	}
-	return len;
+	return 1;
 }
 
-static int readchar(struct pollfd * fds) {
-	fds->events = POLLIN;
-	int rc = poll(fds, 1, D0_READ_TIMEOUT);
-	if (rc < 0) {
-		return -1;
-	} else if (rc == 0) { // timeout
-		return -1;
+// wall clock in milliseconds for the receive timestamps
+static uint64_t realtime_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// monotonic clock in milliseconds for the step deadlines
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// set the baud rate now, the callers wait until the output queue is sent (outq_empty)
+static void setspeed(D0 * d0, speed_t speed)
+{
+	struct termios tio;
+	d0->stats.ioctls += 2;
+	if (tcgetattr(d0->_fds.fd, &tio) == 0) {
+		cfsetspeed(&tio, speed);
+		tcsetattr(d0->_fds.fd, TCSANOW, &tio);
 	}
-	unsigned char c;
-	rc = read(fds->fd, &c, 1);
-	if (rc != 1)
-		return -1;
-	return c;
 }
 
-// parse obis line into val (which should be cleared before)
+// whether everything written to the port is sent, without blocking like tcdrain
+static int outq_empty(D0 * d0)
+{
+	int queued = 0;
+	++d0->stats.ioctls;
+	return ioctl(d0->_fds.fd, TIOCOUTQ, &queued) != 0 || queued == 0;
+}
+
+// set the line speed for mode D push telegrams: maxbaud if it was lowered, else D0_PUSH_BAUD
+static void push_speed(D0 * d0)
+{
+	int baud = d0->maxbaud < D0_MAXBAUD ? d0->maxbaud : D0_PUSH_BAUD;
+	int z = DIM(bauds)-1;
+	while (z > 0 && bauds[z].baud > baud)
+		--z;
+	d0->baud = bauds[z].baud;
+	setspeed(d0, bauds[z].speed);
+	// drop the telegrams received at the old speed or before the first readout
+	++d0->stats.ioctls;
+	tcflush(d0->_fds.fd, TCIFLUSH);
+}
+
+void d0_stamp(D0 * d0, size_t after)
+{
+	if (d0->_rxts && d0->baud > 0)
+		d0->tsms = d0->_rxts - (uint64_t)after * 10000 / d0->baud;
+}
+
+// choose the baud rate from the identification (/ISk5MT171-0222: '5' is 9600 baud in mode C).
+// returns the index in bauds[], 0 (300 baud) if the meter doesn't support mode C or we fall back
+static int choose_baud(D0 * d0)
+{
+	int z = d0->id[4] - '0';
+	if (z <= 0 || z >= DIM(bauds) || d0->_fallback > 0)
+		return 0;
+	while (z > 0 && bauds[z].baud > d0->maxbaud)
+		--z;
+	return z;
+}
+
+// give back the last d0_alloc of size bytes at p
+static void arena_drop(D0 * d0, const char * p, size_t size) {
+	struct d0arena * a = d0->_cur;
+	if (a && p + size == a->mem + a->used)
+		a->used -= size;
+}
+
+// parse obis line into val, the line is copied into the register storage and split there
+static int parse_obis(D0 * d0, const char * line, struct d0val * val) {
+	size_t len = strlen(line);
+	char * buf = d0_alloc(d0, len+1);
+	if (buf == NULL)
+		return 0;
+	memcpy(buf, line, len+1);
+	if (d0_parse_obis(buf, val))
+		return 1;
+	arena_drop(d0, buf, len+1);
+	return 0;
+}
+
 int d0_parse_obis(char * buf, struct d0val * val) {
 	// 0-0:C.1.0*255(47387161)
 	// 1-0:1.8.0*255(000000.4 kWh)
+	// 1.8.0(000000.4*kWh)
+	val->obis = 0;
 	char * p1 = strchr(buf, '(');
-	if (p1 == NULL || p1-buf >= sizeof(val->id))
+	if (p1 == NULL)
 		return 0;
-	*p1 = 0;
-	strncpy(val->id, buf, p1-buf);
-	++p1;
+	*p1++ = 0;
+	val->id = buf;
+	d0_obis_parse(buf, &val->obis);
 
 	char * p2 = strpbrk(p1, " *)");
-	if (p2 == NULL || p2-p1 >= sizeof(val->val))
+	if (p2 == NULL)
 		return 0;
 	char c = *p2;
 	*p2 = 0;
-	strncpy(val->val, p1, p2-p1);
-	if (c == ' ') {
+	val->val = p1;
+	val->unit = p2; // empty
+	if (c == ' ' || c == '*') {
 		++p2;
 		p1 = strchr(p2, ')');
-		if (p1 == NULL || p1-p2 >= sizeof(val->unit))
+		if (p1 == NULL)
 			return 0;
 		*p1 = 0;
-		strncpy(val->unit, p2, p1-p2);
+		val->unit = p2;
 	}
 	
 	return 1;
 }
 
+// parse a decimal value group of an obis code, returns the number of digits
+static size_t obis_group(const char * s, unsigned * v) {
+	size_t n = 0;
+	*v = 0;
+	while (s[n] >= '0' && s[n] <= '9' && n < 3)
+		*v = *v * 10 + s[n++] - '0';
+	return *v <= 255 ? n : 0;
+}
+
+static void parse_error(D0 * d0, const char * fmt, unsigned char c) {
+	snprintf(d0->errstr, sizeof(d0->errstr), fmt, c);
+	d0->_p.state = D0_ERROR;
+}
+
+// handle a complete line (without line end)
+static void parse_line(D0 * d0, char * line) {
+	struct d0parser * p = &d0->_p;
+	if (p->state == D0_IDENT) {
+		snprintf(d0->id, sizeof(d0->id), "%.*s", (int)sizeof(d0->id)-1, line);
+		p->state = D0_STX;
+	} else {
+		struct d0val * val = d0_val_new(d0);
+		if (!val || !parse_obis(d0, line, val))
+			return;
+		if (val->obis == D0_OBIS_SERIAL) {
+			snprintf(d0->serial, sizeof(d0->serial), "%.*s", (int)sizeof(d0->serial)-1, val->val);
+			snprintf(d0->_serialid, sizeof(d0->_serialid), "%.*s", (int)sizeof(d0->_serialid)-1, val->id);
+		} else if (val->obis == D0_OBIS_PROPID)
+			snprintf(d0->propid, sizeof(d0->propid), "%.*s", (int)sizeof(d0->propid)-1, val->val);
+		if (d0->_filter && !d0->_filter(d0, val->obis, d0->_filter_arg)) {
+			// discarded, the slot and the copy of the line are used for the next one
+			arena_drop(d0, val->id, strlen(line)+1);
+			return;
+		}
+		++d0->vals;
+	}
+}
+
+// parse programming mode messages: SOH/STX ... ETX BCC, or a single ACK/NAK. a complete
+// message is in p->line, without the control characters (SOH P0 STX (pw) ETX is "P0(pw)")
+static enum d0_state msg_parse(D0 * d0, const char * buf, size_t len) {
+	struct d0parser * p = &d0->_p;
+	for (const char * end = buf+len; buf < end && p->state < D0_DONE; ++buf) {
+		unsigned char c = *buf;
+		switch (p->state) {
+		case D0_STX:
+			if (c == SOH || c == STX) {
+				p->state = D0_DATA;
+				p->bcc = 0;
+				p->len = 0;
+			} else if (c == ACK || c == NAK) {
+				p->line[0] = c;
+				p->line[1] = 0;
+				p->state = D0_DONE;
+			} // else: skip garbage
+			break;
+		case D0_DATA:
+			p->bcc ^= c;
+			if (c == ETX) {
+				p->line[p->len] = 0;
+				p->state = D0_BCC;
+			} else if (c != STX && p->len < sizeof(p->line)-1) {
+				p->line[p->len++] = c;
+			}
+			break;
+		case D0_BCC:
+			if (c == p->bcc) {
+				p->state = D0_DONE;
+			} else {
+				snprintf(d0->errstr, sizeof(d0->errstr), "checksum mismatch: calculated %02hhx but got %02hhx", p->bcc, c);
+				p->state = D0_ERROR;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return p->state;
+}
+
+/* readout steps ****************************************************/
+
+// remember the ids of the serial and the registers the filter accepts for selective readouts
+static void learn(D0 * d0) {
+	size_t len = 0;
+	if (!d0->serial[0])
+		return; // can't identify the meter
+	for (int pass=0; pass<2; ++pass) {
+		len = strlen(d0->_serialid) + 1;
+		if (pass)
+			memcpy(d0->_sel, d0->_serialid, len);
+		for (int i=0; i<d0->vals; ++i) {
+			struct d0val * val = &d0->val[i];
+			if (val->obis == 0 || val->obis == D0_OBIS_SERIAL || !d0->_filter(d0, val->obis, d0->_filter_arg))
+				continue;
+			size_t n = strlen(val->id) + 1;
+			if (pass)
+				memcpy(d0->_sel + len, val->id, n);
+			len += n;
+		}
+		if (pass == 0) {
+			char * sel = realloc(d0->_sel, len);
+			if (!sel)
+				return; // keep the old list, or full readouts if there is none
+			d0->_sel = sel;
+		}
+	}
+	d0->_sellen = len;
+}
+
+static void forget(D0 * d0) {
+	free(d0->_sel);
+	d0->_sel = NULL;
+	d0->_sellen = 0;
+}
+
+// forget the register ids of the other meters on the bus, too
+static void forget_all(D0 * d0) {
+	forget(d0);
+	for (int i=0; i<d0->_nmeters; ++i) {
+		free(d0->_meters[i].sel);
+		d0->_meters[i].sel = NULL;
+		d0->_meters[i].sellen = 0;
+	}
+}
+
+// state of the meter at addr, added if it is new. NULL if out of memory
+static struct d0meter * meter(D0 * d0, const char * addr) {
+	for (int i=0; i<d0->_nmeters; ++i)
+		if (!strcmp(d0->_meters[i].addr, addr))
+			return &d0->_meters[i];
+	struct d0meter * m = realloc(d0->_meters, (d0->_nmeters + 1) * sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	d0->_meters = m;
+	m += d0->_nmeters++;
+	memset(m, 0, sizeof(*m));
+	strcpy(m->addr, addr);
+	return m;
+}
+
+static int rx_timeout(D0 * d0)
+{
+	if (d0->_timeout > 0)
+		return d0->_timeout;
+	return d0->proto == D0_IEC ? D0_READ_TIMEOUT : D0_PUSH_TIMEOUT;
+}
+
+// end the readout with state, back to 300 baud after a baud rate switch
+static enum d0_state finish(D0 * d0, enum d0_state state)
+{
+	d0->_p.state = state;
+	if (d0->_prog) {
+		txcmd(d0, "B0", NULL); // leave programming mode
+		if (state == D0_ERROR) {
+			forget(d0);
+			d0->_selfail = D0_FALLBACK_READS;
+			char buf[sizeof(d0->errstr)];
+			snprintf(buf, sizeof(buf), "programming mode: %.50s (full readouts for the next %d times)", d0->errstr, d0->_selfail);
+			strcpy(d0->errstr, buf);
+		}
+	} else if (state == D0_DONE && d0->_selective && d0->_filter && d0->proto == D0_IEC) {
+		if (d0->_selfail > 0)
+			--d0->_selfail;
+		else
+			learn(d0);
+	}
+	if (d0->_z > 0) {
+		// back to 300 baud. if B0 is still being sent, d0_start_read does it before the next request
+		if (outq_empty(d0)) {
+			setspeed(d0, B300);
+			d0->_z = 0;
+		}
+		if (state == D0_ERROR) {
+			d0->_fallback = D0_FALLBACK_READS;
+			char buf[sizeof(d0->errstr)];
+			snprintf(buf, sizeof(buf), "%.70s (at %d baud, using 300 baud for the next %d readouts)", d0->errstr, d0->baud, d0->_fallback);
+			strcpy(d0->errstr, buf);
+		}
+	}
+	d0->_step = D0_IDLE;
+	++d0->stats.readouts;
+	if (state == D0_ERROR)
+		++d0->stats.errors;
+	if (d0->_cb)
+		d0->_cb(d0, state, d0->_cb_arg);
+	return state;
+}
+
+// i/o error or timeout (not a parse error) in the current step
+static enum d0_state io_error(D0 * d0, const char * what, int err)
+{
+	char buf[sizeof(d0->errstr)];
+	if (err)
+		snprintf(buf, sizeof(buf), "%s error %d: %s", what, err, strerror(err));
+	else
+		snprintf(buf, sizeof(buf), "%s", what);
+	if (d0->_step == D0_SIGNON)
+		snprintf(d0->errstr, sizeof(d0->errstr), "com init: %.100s", buf);
+	else
+		strcpy(d0->errstr, buf);
+	return finish(d0, D0_ERROR);
+}
+
+// got the identification: acknowledge and switch to the highest common baud rate
+static enum d0_state signed_on(D0 * d0, long long now)
+{
+	int z = choose_baud(d0);
+	char pullseq[8];
+	strcpy(pullseq, PULLSEQ);
+	pullseq[2] = '0' + z;
+	d0->_prog = d0->_sel && d0->_selfail == 0;
+	if (d0->_prog) {
+		pullseq[3] = '1';
+		d0->_selpos = 0;
+		d0->_p.state = D0_STX; // for msg_parse
+		d0->_p.len = 0;
+	}
+	if (!txline(d0, pullseq))
+		return finish(d0, D0_ERROR);
+	d0->baud = bauds[z].baud;
+	d0->_z = z;
+	d0->_holdoff = 0;
+	if (z > 0) {
+		// the meter switches after our ack, so we have to wait until it is sent completely
+		// before we switch, too. that takes 10 bit times per character at 300 baud
+		d0->_step = D0_SWITCH;
+		d0->_deadline = now + (strlen(pullseq) + 2) * 10 * 1000 / 300 + 1;
+	} else {
+		if (d0->_fallback > 0)
+			--d0->_fallback;
+		d0->_step = d0->_prog ? D0_PROG : D0_RECV;
+		d0->_deadline = now + rx_timeout(d0);
+	}
+	return d0->_p.state;
+}
+
+// got a programming mode message, send the next read command or end the readout
+static enum d0_state prog_msg(D0 * d0, long long now)
+{
+	struct d0parser * p = &d0->_p;
+	if (d0->_step == D0_PROG) {
+		if (p->line[0] != 'P') {
+			if (p->line[0] == NAK)
+				snprintf(d0->errstr, sizeof(d0->errstr), "refused");
+			else
+				snprintf(d0->errstr, sizeof(d0->errstr), "unexpected answer '%.20s'", p->line);
+			return finish(d0, D0_ERROR);
+		}
+	} else { // answer to the read command: (value*unit), some meters repeat the id
+		const char * id = d0->_sel + d0->_selpos;
+		if (p->line[0] == NAK || strstr(p->line, "ERROR")) {
+			snprintf(d0->errstr, sizeof(d0->errstr), "reading %.20s failed", id);
+			return finish(d0, D0_ERROR);
+		}
+		char line[BUFSIZE];
+		snprintf(line, sizeof(line), "%s%s", p->line[0] == '(' ? id : "", p->line);
+		parse_line(d0, line);
+		d0->_selpos += strlen(id) + 1;
+		if (d0->_selpos >= d0->_sellen)
+			return finish(d0, D0_DONE);
+	}
+	char data[BUFSIZE];
+	snprintf(data, sizeof(data), "%s()", d0->_sel + d0->_selpos);
+	if (!txcmd(d0, D0_READCMD, data))
+		return finish(d0, D0_ERROR);
+	p->state = D0_STX;
+	p->len = 0;
+	d0->_step = D0_CMD;
+	d0->_deadline = now + rx_timeout(d0);
+	return p->state;
+}
+
+/* register storage *************************************************/
+
+struct d0val * d0_val_new(D0 * d0) {
+	if (d0->vals >= d0->_valsize) {
+		int size = d0->_valsize ? 2 * d0->_valsize : 16;
+		struct d0val * val = realloc(d0->val, size * sizeof(*val));
+		if (val == NULL)
+			return NULL;
+		d0->val = val;
+		d0->_valsize = size;
+	}
+	struct d0val * val = &d0->val[d0->vals];
+	memset(val, 0, sizeof(*val));
+	return val;
+}
+
+static struct d0arena * arena_block(void) {
+	struct d0arena * a = malloc(sizeof(struct d0arena));
+	if (a) {
+		a->next = NULL;
+		a->used = 0;
+	}
+	return a;
+}
+
+char * d0_alloc(D0 * d0, size_t size) {
+	if (size > D0_ARENA_BLOCK)
+		return NULL;
+	if (d0->_cur == NULL) { // first use
+		if ((d0->_arena = arena_block()) == NULL)
+			return NULL;
+		d0->_cur = d0->_arena;
+	}
+	struct d0arena * a = d0->_cur;
+	if (a->used + size > D0_ARENA_BLOCK) {
+		// next block, kept from an earlier readout or a new one
+		if (a->next == NULL && (a->next = arena_block()) == NULL)
+			return NULL;
+		a = d0->_cur = a->next;
+		a->used = 0;
+	}
+	char * p = a->mem + a->used;
+	a->used += size;
+	return p;
+}
+
+static void arena_reset(D0 * d0) {
+	d0->_cur = d0->_arena;
+	if (d0->_cur)
+		d0->_cur->used = 0;
+}
 
 /* exported lib functions *******************************************/
 
+size_t d0_obis_parse(const char * s, uint64_t * obis) {
+	unsigned g[6] = { 1, 0, 0, 0, 0, 255 };
+	const char * p = s;
+	size_t n;
+	// A-B: is optional, so look ahead for the '-' (a is group C if it isn't there)
+	unsigned a;
+	if ((n = obis_group(p, &a)) && p[n] == '-') {
+		g[0] = a;
+		p += n+1;
+		if (!(n = obis_group(p, &g[1])) || p[n] != ':')
+			return 0;
+		p += n+1;
+	}
+	const char * letter = strchr("CFLP", *p);
+	if (*p && letter) {
+		g[2] = 96 + (letter - "CFLP");
+		++p;
+		if (p - s == 1)
+			g[0] = 0; // C.1.0 is 0-0:C.1.0
+	} else if ((n = obis_group(p, &g[2]))) {
+		p += n;
+	} else {
+		return 0;
+	}
+	for (int i=3; i<5; ++i) {
+		if (*p != '.' || !(n = obis_group(p+1, &g[i])))
+			return 0;
+		p += n+1;
+	}
+	if (*p == '*') {
+		if (!(n = obis_group(p+1, &g[5])))
+			return 0;
+		p += n+1;
+	}
+	*obis = D0_OBIS(g[0], g[1], g[2], g[3], g[4], g[5]);
+	return p - s;
+}
+
+char * d0_obis_format(uint64_t obis, char * buf, size_t size) {
+	snprintf(buf, size, "%u-%u:%u.%u.%u*%u", (unsigned)(obis>>40 & 0xff), (unsigned)(obis>>32 & 0xff),
+		(unsigned)(obis>>24 & 0xff), (unsigned)(obis>>16 & 0xff), (unsigned)(obis>>8 & 0xff), (unsigned)(obis & 0xff));
+	return buf;
+}
+
+void d0_set_filter(D0 * d0, d0_filter filter, void * arg) {
+	d0->_filter = filter;
+	d0->_filter_arg = arg;
+}
+
+void d0_parse_reset(D0 * d0) {
+	memset(d0->id, 0, sizeof(d0->id));
+	memset(d0->serial, 0, sizeof(d0->serial));
+	memset(d0->propid, 0, sizeof(d0->propid));
+	d0->vals = 0;
+	d0->tsms = 0;
+	arena_reset(d0);
+	memset(&d0->_p, 0, sizeof(d0->_p));
+	d0->_p.state = D0_IDENT;
+	if (d0->_sml)
+		sml_reset(d0->_sml);
+}
+
+// IEC 62056-21 parser, returns the number of bytes used (less than len after the end
+// of the telegram)
+static size_t iec_parse(D0 * d0, const char * buf, size_t len) {
+	struct d0parser * p = &d0->_p;
+	const char * start = buf;
+	for (const char * end = buf+len; buf < end && p->state < D0_DONE; ++buf) {
+		unsigned char c = *buf;
+		switch (p->state) {
+		case D0_IDENT:
+			if (p->len == 0 && c != '/')
+				continue; // skip garbage before the start of the identification
+			if (p->len == 0 && d0->proto == D0_PUSH)
+				d0_stamp(d0, end - buf - 1);
+			break;
+		case D0_STX:
+			if (d0->proto == D0_PUSH) {
+				// mode D has no STX, the data follows an empty line
+				if (c == '\r' || c == '\n')
+					continue;
+				p->state = D0_DATA;
+				--buf; // parse c as data
+				continue;
+			}
+			if (c == STX)
+				p->state = D0_DATA;
+			else
+				parse_error(d0, "expected STX, got %02hhx", c);
+			continue;
+		case D0_DATA:
+			if (d0->proto == D0_PUSH) {
+				if (c == '!' && p->len == 0) {
+					p->state = D0_DONE; // mode D has no ETX and checksum
+					continue;
+				}
+				if (c == '/') {
+					// '/' is not allowed in data: the next telegram, the current one was cut off
+					d0_parse_reset(d0);
+					d0_stamp(d0, end - buf - 1);
+					break;
+				}
+			}
+			p->bcc ^= c;
+			if (c == ETX && d0->proto != D0_PUSH) {
+				p->state = D0_BCC;
+				continue;
+			}
+			break;
+		case D0_BCC:
+			if (c == p->bcc) {
+				p->state = D0_DONE;
+			} else {
+				snprintf(d0->errstr, sizeof(d0->errstr), "checksum mismatch: calculated %02hhx but got %02hhx", p->bcc, c);
+				p->state = D0_ERROR;
+			}
+			continue;
+		default:
+			continue;
+		}
+		// collect line
+		if (c == '\n') {
+			if (p->len > 0 && p->line[p->len-1] == '\r')
+				--p->len;
+			p->line[p->len] = 0;
+			parse_line(d0, p->line);
+			p->len = 0;
+		} else if (p->len < sizeof(p->line)-1) {
+			p->line[p->len++] = c;
+		} // else: line too long, it will fail to parse
+	}
+	return buf - start;
+}
+
+enum d0_state d0_parse(D0 * d0, const char * buf, size_t len) {
+	if (d0->proto == D0_SML)
+		return sml_parse(d0, (const unsigned char *)buf, len);
+	iec_parse(d0, buf, len);
+	return d0->_p.state;
+}
+
 D0 * d0_open(const char* dev) {
-	// open and configure serial port
-//	int fd = open(dev, O_RDWR|O_NONBLOCK|O_NOCTTY); // |O_CLOEXEC);
-	int fd = open(dev, O_RDWR|O_NOCTTY); // |O_CLOEXEC);
-	if (fd < 0)
-		return NULL;
-	tcflush(fd, TCIFLUSH);
-	struct termios tio;
-	memset(&tio, 0, sizeof(tio));
-	cfmakeraw(&tio);
-	tio.c_cflag = CS7|PARENB;
-	cfsetspeed(&tio, B300);
-	//tio.c_cc[VMIN] = 32; // we'd need to split input for that
-	//tio.c_cc[VTIME] = 1;
-	tcsetattr(fd, TCSANOW, &tio);
+	int fd = -1;
+	if (dev != NULL) {
+		// open and configure serial port
+		fd = open(dev, O_RDWR|O_NOCTTY|O_NONBLOCK); // |O_CLOEXEC);
+		if (fd < 0)
+			return NULL;
+		tcflush(fd, TCIFLUSH);
+		struct termios tio;
+		memset(&tio, 0, sizeof(tio));
+		cfmakeraw(&tio);
+		tio.c_cflag = CS7|PARENB;
+		cfsetspeed(&tio, B300);
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
 
 	D0 * d0 = calloc(1, sizeof(D0));
 	if (d0 == NULL) {
-		close(fd);
+		if (fd >= 0)
+			close(fd);
 		return NULL;
 	}
 	d0->_fds.fd = fd;
+	d0->maxbaud = D0_MAXBAUD;
+	d0_parse_reset(d0);
 
 	return d0;
 }
 
 void d0_close(D0* d0) {
 	if (d0 != NULL) {
-		close(d0->_fds.fd);
+		if (d0->_fds.fd >= 0)
+			close(d0->_fds.fd);
+		free(d0->_sml);
+		free(d0->val);
+		forget_all(d0);
+		free(d0->_meters);
+		while (d0->_arena) {
+			struct d0arena * a = d0->_arena;
+			d0->_arena = a->next;
+			free(a);
+		}
 		free(d0);
 	}
 }
 
-int d0_read(D0 * d0) {
-	struct pollfd * fds = & d0->_fds;
-	int len;
-	char buf[BUFSIZE];
-
-	// clean previously read data	
-	memset(d0->id, 0, sizeof(d0->id));
-	memset(d0->serial, 0, sizeof(d0->serial));
-	memset(d0->propid, 0, sizeof(d0->propid));
+// send the sign on request, returns 0 on errors
+static int signon(D0 * d0, long long now)
+{
+	char req[D0_ADDRLEN+4];
+	snprintf(req, sizeof(req), "/?%s!", d0->_addr);
+	if (!txline(d0, req))
+		return 0;
+	d0->_step = D0_SIGNON;
+	d0->_deadline = now + rx_timeout(d0);
+	return 1;
+}
 
-	txline(fds, "/?!");
-	len = rxline(fds, buf); // /ISk5MT171-0222
-	if (len <= 0 || buf[0] != '/') {
-		if (len < 0)
-			snprintf(d0->errstr, sizeof(d0->errstr), "com init: %s", buf);
-		else
-			snprintf(d0->errstr, sizeof(d0->errstr), "no or invalid response to init");
+int d0_start_read(D0 * d0) {
+	int fd = d0->_fds.fd;
+	if (fd < 0) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "no port");
 		return 0;
 	}
-	char * end = strpbrk(buf, "\r\n");
-	if (end != NULL)
-		*end = 0;
-	strncat(d0->id, buf, sizeof(d0->id));
 
-	txline(fds, PULLSEQ);
-	if (readchar(fds) != STX)
-		return 0;
-	unsigned char chks = 0, chks_got = 0; // checksum
-	for (d0->vals=0; d0->vals<DIM(d0->val);) {
-		len = rxline(fds, buf);
-		if (len < 0) {
-			snprintf(d0->errstr, sizeof(d0->errstr), "com err [%d]: %s", d0->vals-1, buf);
-			return 0;
+	// clean previously read data
+	d0_parse_reset(d0);
+	d0->_prog = 0;
+	d0->_serialid[0] = 0;
+	d0->_holdoff = 0;
+
+	if (d0->proto == D0_PUSH) {
+		// the meter sends on its own. keep everything received after the last telegram
+		d0->_step = D0_RECV;
+	} else if (d0->proto == D0_SML) {
+		// the meter sends on its own, drop old telegrams and wait for the next one
+		++d0->stats.ioctls;
+		tcflush(fd, TCIFLUSH);
+		d0->baud = 9600;
+		d0->_step = D0_RECV;
+	} else if (d0->_z > 0) {
+		// the line is still at the baud rate of the last readout
+		d0->_step = D0_RESET;
+		d0->_deadline = now_ms();
+		return 1;
+	} else {
+		return signon(d0, now_ms());
+	}
+	d0->_deadline = now_ms() + rx_timeout(d0);
+	return 1;
+}
+
+enum d0_state d0_process(D0 * d0) {
+	struct d0parser * p = &d0->_p;
+	if (d0->_step == D0_IDLE)
+		return p->state;
+	long long now = now_ms();
+
+	if (d0->_step == D0_SWITCH || d0->_step == D0_RESET) {
+		if (now < d0->_deadline)
+			return p->state;
+		if (!outq_empty(d0)) {
+			d0->_deadline = now + 10; // still sending the ack or B0
+			return p->state;
 		}
-		if (len == 0)
-			continue; // emtpy line??
-		if (buf[0] == ETX) { // end of transmission
-			if (len < 2) // no checksum!?
-				return 0;
-			chks ^= buf[0];
-			chks_got = buf[1];
-			break;
+		if (d0->_step == D0_RESET) {
+			d0->_z = 0;
+			setspeed(d0, B300);
+			if (!signon(d0, now))
+				return finish(d0, D0_ERROR);
+			return p->state;
 		}
-		for (int i=0; i<len; ++i)
-			chks ^= buf[i];
-		struct d0val * val = &(d0->val[d0->vals]);
-		memset(val, 0, sizeof(*val));
-		if (d0_parse_obis(buf, val)) {
-			++d0->vals;
-			if (!strcmp(val->id, "0-0:C.1.0*255"))
-				strncpy(d0->serial, val->val, sizeof(d0->serial));
-			else if (!strcmp(val->id, "1-0:0.0.0*255"))
-				strncpy(d0->propid, val->val, sizeof(d0->propid));
+		setspeed(d0, bauds[d0->_z].speed);
+		d0->_step = d0->_prog ? D0_PROG : D0_RECV;
+		d0->_deadline = now + rx_timeout(d0);
+		return p->state;
+	}
+
+	// read everything that is available, after the rest of the last push telegram
+	ssize_t got, total = 0;
+	int again;
+	do {
+		char * rx = d0->_rx;
+		if ((again = d0->_rxlen > 0)) {
+			rx += d0->_rxpos;
+			got = d0->_rxlen;
+			d0->_rxlen = 0;
+		} else {
+			++d0->stats.reads;
+			got = read(d0->_fds.fd, d0->_rx, sizeof(d0->_rx));
+			if (got <= 0)
+				break;
+			d0->_rxts = realtime_ms();
+			total += got;
+			again = got == sizeof(d0->_rx);
+		}
+		if (d0->_step == D0_PROG || d0->_step == D0_CMD) {
+			if (msg_parse(d0, rx, got) == D0_ERROR)
+				return finish(d0, D0_ERROR);
+			if (p->state == D0_DONE)
+				return prog_msg(d0, now);
+			continue;
 		}
+		if (d0->proto == D0_PUSH) {
+			size_t used = iec_parse(d0, rx, got);
+			if (used < got) {
+				d0->_rxpos = rx - d0->_rx + used;
+				d0->_rxlen = got - used;
+			}
+		} else {
+			d0_parse(d0, rx, got);
+		}
+		// push telegrams are stamped at their start sequence by the parsers
+		if (!d0->tsms && (p->state > D0_IDENT || p->len > 0))
+			d0->tsms = d0->_rxts;
+		if (p->state == D0_ERROR)
+			return finish(d0, D0_ERROR);
+		if (p->state == D0_DONE)
+			return finish(d0, D0_DONE);
+		if (d0->_step == D0_SIGNON && p->state >= D0_STX)
+			return signed_on(d0, now);
+	} while (again);
+	if (got == 0) // device error?
+		return io_error(d0, "read nothing", 0);
+	if (got < 0 && errno != EAGAIN && errno != EINTR)
+		return io_error(d0, "read", errno);
+
+	if (total > 0) {
+		d0->_deadline = now + rx_timeout(d0);
+		// no holdoff while waiting for the start of a push telegram, for an accurate timestamp
+		d0->_holdoff = d0->proto == D0_PUSH && p->state == D0_IDENT ? 0 : now + D0_HOLDOFF;
+	} else if (now >= d0->_deadline) {
+		return io_error(d0, "timeout", 0);
+	} else {
+		d0->_holdoff = 0; // nothing new, wait for the port again
+	}
+	return p->state;
+}
+
+void d0_cancel(D0 * d0) {
+	if (d0->_step != D0_IDLE) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "cancelled");
+		finish(d0, D0_ERROR);
 	}
-	if (chks != chks_got) {
-		snprintf(d0->errstr, sizeof(d0->errstr) , "checksum mismatch: calculated %02hhx but got %02hhx", chks, chks_got);
+}
+
+void d0_set_callback(D0 * d0, d0_callback cb, void * arg) {
+	d0->_cb = cb;
+	d0->_cb_arg = arg;
+}
+
+int d0_get_fd(D0 * d0) {
+	return d0->_fds.fd;
+}
+
+short d0_events(D0 * d0) {
+	if (d0->_step != D0_IDLE && d0->_step != D0_SWITCH && d0->_step != D0_RESET && d0->_holdoff == 0 && d0->_rxlen == 0)
+		return POLLIN;
+	return 0;
+}
+
+int d0_timeout(D0 * d0) {
+	if (d0->_step == D0_IDLE)
+		return -1;
+	if (d0->_rxlen > 0)
+		return 0; // the next telegram is already received (partly)
+	long long due = d0->_deadline;
+	if (d0->_holdoff > 0 && d0->_holdoff < due)
+		due = d0->_holdoff;
+	long long left = due - now_ms();
+	return left > 0 ? left : 0;
+}
+
+int d0_read(D0 * d0) {
+	struct pollfd * fds = &d0->_fds;
+	if (!d0_start_read(d0))
+		return 0;
+	enum d0_state state;
+	do {
+		fds->events = d0_events(d0);
+		++d0->stats.polls;
+		poll(fds, 1, d0_timeout(d0));
+		state = d0_process(d0);
+	} while (state < D0_DONE);
+	return state == D0_DONE;
+}
+
+void d0_set_selective(D0 * d0, int on) {
+	d0->_selective = on;
+	if (!on)
+		forget_all(d0);
+}
+
+int d0_set_address(D0 * d0, const char * addr) {
+	if (addr == NULL)
+		addr = "";
+	if (strlen(addr) > D0_ADDRLEN)
 		return 0;
+	if (!strcmp(d0->_addr, addr))
+		return 1;
+	// put the state of the current meter aside and get the one of the next
+	struct d0meter * m = meter(d0, d0->_addr);
+	if (m) {
+		m->fallback = d0->_fallback;
+		m->selfail = d0->_selfail;
+		m->sel = d0->_sel;
+		m->sellen = d0->_sellen;
+		d0->_sel = NULL;
+		d0->_sellen = 0;
+	} else {
+		forget(d0);
+	}
+	strcpy(d0->_addr, addr);
+	d0->_fallback = d0->_selfail = 0;
+	if ((m = meter(d0, addr))) {
+		d0->_fallback = m->fallback;
+		d0->_selfail = m->selfail;
+		d0->_sel = m->sel;
+		d0->_sellen = m->sellen;
+		m->sel = NULL;
 	}
+	return 1;
+}
+
+void d0_set_maxbaud(D0 * d0, int baud) {
+	d0->maxbaud = baud;
+	if (d0->proto == D0_PUSH && d0->_fds.fd >= 0)
+		push_speed(d0);
+}
 
+void d0_set_timeout(D0 * d0, int ms) {
+	d0->_timeout = ms;
+}
+
+int d0_set_protocol(D0 * d0, enum d0_proto proto) {
+	if (proto == D0_SML && !d0->_sml && !(d0->_sml = calloc(1, sizeof(struct sml))))
+		return 0;
+	d0->proto = proto;
+	d0->_rxlen = 0;
+	d0->_z = 0; // the speed is set below
+	d0_parse_reset(d0);
+	struct termios tio;
+	if (d0->_fds.fd >= 0 && tcgetattr(d0->_fds.fd, &tio) == 0) {
+		tio.c_cflag &= ~(CSIZE|PARENB);
+		if (proto == D0_SML) {
+			tio.c_cflag |= CS8;
+			cfsetspeed(&tio, B9600);
+		} else {
+			tio.c_cflag |= CS7|PARENB;
+			cfsetspeed(&tio, B300);
+		}
+		tcsetattr(d0->_fds.fd, TCSANOW, &tio);
+		if (proto == D0_PUSH)
+			push_speed(d0);
+	}
 	return 1;
 }
 
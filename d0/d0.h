@@ -2,19 +2,109 @@
 #define D0_H
 
 #include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// interface version, the soname of the library is libd0.so.<D0_ABI>. 2: registers in
+// the growing val list with pointers to the register storage instead of val[8] with arrays
+#define D0_ABI 2
 
 #define BUFSIZE 64
+// size of the receive buffer
+#define D0_RXBUF 256
+
+// max length of a device address
+#define D0_ADDRLEN 32
 
-char * PULLSEQ = "\006000";
+// highest baud rate of protocol mode C
+#define D0_MAXBAUD 19200
+// default baud rate of mode D push telegrams
+#define D0_PUSH_BAUD 2400
+
+#define SOH '\001'
 #define STX '\002'
 #define ETX '\003'
 #define ACK '\006'
+#define NAK '\025'
+
+// protocols
+enum d0_proto {
+	D0_IEC, // IEC 62056-21 request/response (mode A/B/C)
+	D0_SML, // SML push telegrams (EDL21/eHZ), 9600 baud 8N1
+	D0_PUSH // IEC 62056-21 mode D, the meter sends /ident, data lines and ! on its own (7E1)
+};
+
+// parser states, in the order of a readout
+enum d0_state {
+	D0_IDENT, // waiting for identification line /ISk5MT171-0222
+	D0_STX, // waiting for start of data block
+	D0_DATA, // reading data lines
+	D0_BCC, // waiting for block check character after ETX
+	D0_DONE, // readout complete and checksum ok
+	D0_ERROR // see errstr
+};
 
+// OBIS code A-B:C.D.E*F packed into 48 bits, A in the highest byte
+#define D0_OBIS(a,b,c,d,e,f) ((uint64_t)(a)<<40 | (uint64_t)(b)<<32 | (uint64_t)(c)<<24 | (uint64_t)(d)<<16 | (uint64_t)(e)<<8 | (uint64_t)(f))
+#define D0_OBIS_SERIAL D0_OBIS(0,0,96,1,0,255) // 0-0:C.1.0*255
+#define D0_OBIS_PROPID D0_OBIS(1,0,0,0,0,255) // 1-0:0.0.0*255
 
+typedef struct d0dev D0;
+
+// register filter, called with the obis code before a register is stored. d0->serial is
+// set if the meter has sent it already. return 0 to discard the register
+typedef int (*d0_filter)(D0 * d0, uint64_t obis, void * arg);
+
+// completion callback of a readout, state is D0_DONE or D0_ERROR (see errstr)
+typedef void (*d0_callback)(D0 * d0, enum d0_state state, void * arg);
+
+// strings point into the register storage of the readout, valid until the next readout
 struct d0val {
-	char id[16];
-	char val[16];
-	char unit[16];
+	uint64_t obis; // packed code of id, 0 if id is no valid obis code
+	char * id;
+	char * val;
+	char * unit; // "" if there's no unit
+};
+
+// block of register storage, the blocks are kept and reused for the next readout
+#define D0_ARENA_BLOCK 1024
+struct d0arena {
+	struct d0arena * next;
+	size_t used;
+	char mem[D0_ARENA_BLOCK];
+};
+
+// steps of a readout, see d0_process
+enum d0_step {
+	D0_IDLE, // no readout running
+	D0_SIGNON, // sent /?!, waiting for the identification
+	D0_SWITCH, // sent the ack, waiting until it is out before switching the baud rate
+	D0_RECV, // receiving the data block (or an SML telegram)
+	D0_PROG, // programming mode: waiting for the password request P0
+	D0_CMD, // programming mode: waiting for the answer to a read command
+	D0_RESET // waiting until B0 is sent before going back to 300 baud for the next request
+};
+
+// resumable parser state, data can be fed in chunks of any size
+struct d0parser {
+	enum d0_state state;
+	unsigned char bcc; // checksum of the data block
+	int len; // length of line
+	char line[BUFSIZE];
+};
+
+// state of a meter on a multi-drop bus, kept while d0_set_address selects another one
+struct d0meter {
+	char addr[D0_ADDRLEN+1];
+	int fallback, selfail; // _fallback and _selfail of the meter
+	char * sel; // _sel of the meter
+	size_t sellen;
+};
+
+// counters since d0_open
+struct d0stats {
+	unsigned long readouts, errors; // finished readouts
+	unsigned long reads, writes, ioctls, polls; // system calls for the port (polls only in d0_read)
 };
 
 struct d0dev {
@@ -23,19 +113,114 @@ struct d0dev {
 	char serial[16]; // 0-0:C.1.0*255(12345678)
 	char propid[16]; // 1-0:0.0.0*255(987654321)
 	int vals;
- 	struct d0val val[8];
+	struct d0val * val; // registers of the readout, grows as needed
 	char errstr[BUFSIZE*2];
+	int baud; // baud rate used for the data of the last readout
+	uint64_t tsms; // receive time of the start of the telegram (ms since epoch)
+	struct d0stats stats;
+	int maxbaud; // highest baud rate to switch to in protocol mode C (default D0_MAXBAUD)
+	int _timeout; // receive timeout in ms, 0 for the default of the protocol
+	int _fallback; // readouts left at 300 baud after a failed readout at a higher rate
+	enum d0_proto proto;
+	int _valsize; // allocated size of val
+	struct d0arena * _arena, * _cur; // register storage, current block
+	struct d0parser _p;
+	struct sml * _sml; // SML transport layer state (allocated if proto is D0_SML)
+	d0_filter _filter;
+	void * _filter_arg;
+	d0_callback _cb;
+	void * _cb_arg;
+	int _selective; // read the registers accepted by the filter in programming mode
+	char * _sel; // ids to read, NUL separated, learned from a full readout (NULL: unknown)
+	size_t _sellen, _selpos; // size of _sel, offset of the id read in this step
+	int _selfail; // full readouts left after a failed selective readout
+	int _prog; // this readout uses programming mode
+	char _serialid[BUFSIZE/2]; // id of the serial register as sent by the meter
+	char _addr[D0_ADDRLEN+1]; // device address for the sign on
+	struct d0meter * _meters; // state of the meters at the other addresses
+	int _nmeters;
+	enum d0_step _step;
+	int _z; // baud rate index of the current readout, > 0 until the line is back at 300 baud
+	long long _deadline; // timeout of the current step (monotonic ms)
+	long long _holdoff; // don't poll the port before (monotonic ms), 0 if not set
+	char _rx[D0_RXBUF]; // receive buffer
+	size_t _rxpos, _rxlen; // unparsed rest in _rx after a push telegram (start of the next one)
+	uint64_t _rxts; // time of the last read (ms since epoch), the end of the bytes in _rx
 };
 
-typedef struct d0dev D0;
-
 #define DIM(vec) (sizeof(vec)/sizeof(vec[0]))
 
 
+// open serial port dev. if dev is NULL, no port is opened (only d0_parse can be used then)
 D0* d0_open(const char* dev);
 void d0_close(D0* d0);
+// blocking readout, returns 0 on errors (see errstr)
 int d0_read(D0* d0);
 void d0_dump(D0* d0);
+// device address for the sign on /?<addr>! on multi-drop busses (RS-485), NULL or "" for /?!.
+// the learned register ids and the 300 baud fallback are kept per address. returns 0 if addr
+// is too long
+int d0_set_address(D0* d0, const char * addr);
+// limit the baud rate for mode C readouts, 300 disables the baud rate switch.
+// for D0_PUSH the baud rate of the line (default D0_PUSH_BAUD)
+void d0_set_maxbaud(D0* d0, int baud);
+// receive timeout in milliseconds, 0 for the default (2 s for D0_IEC, 10 s for the push
+// protocols). push meters that send less often need a longer one
+void d0_set_timeout(D0* d0, int ms);
+// set the protocol (D0_IEC is the default), also reconfigures the port. returns 0 on errors
+int d0_set_protocol(D0* d0, enum d0_proto proto);
+// store only registers accepted by filter (NULL: all). the serial and property
+// id are recognized even if their registers are discarded
+void d0_set_filter(D0* d0, d0_filter filter, void * arg);
+// read only the registers accepted by the filter with R5 commands in programming mode. the
+// ids are learned from a full readout, if the meter fails, full readouts are used again for a while
+void d0_set_selective(D0* d0, int on);
 
-#endif
+// parse an obis code at s: A-B:C.D.E*F, or C.D.E with A-B: and *F left out (A 1 or 0 for
+// the letter codes, B 0, F 255). the letters C, F, L and P in group C are 96 to 99.
+// returns the number of characters used, 0 if s doesn't start with an obis code
+size_t d0_obis_parse(const char * s, uint64_t * obis);
+// format obis as A-B:C.D.E*F, returns buf
+char * d0_obis_format(uint64_t obis, char * buf, size_t size);
+// split a data line id(value*unit) in buf into val, the strings point into buf. obis is set
+// with d0_obis_parse (0 if id is no obis code). returns 0 if the line is invalid
+int d0_parse_obis(char * buf, struct d0val * val);
 
+/* non-blocking readout for event loops, any number of meters in one thread:
+ *
+ *	d0_set_callback(d0, done, arg); // optional
+ *	d0_start_read(d0);
+ *	while (readout running) {
+ *		struct pollfd fds = { d0_get_fd(d0), d0_events(d0) };
+ *		poll(&fds, 1, d0_timeout(d0)); // or with all other fds of the loop
+ *		d0_process(d0);
+ *	}
+ *
+ * the port is opened O_NONBLOCK, all reads and writes are done by d0_process. d0_events
+ * is 0 while libd0 only waits for a timer (baud rate switch, collecting data), so the fd
+ * must be polled with the current events after each call. d0_process may be called at any
+ * time, it returns a state before D0_DONE while the readout runs, then D0_DONE or D0_ERROR.
+ * the callback is called when the readout has finished and may start the next one.
+ */
+// send the request (IEC) or start waiting for a telegram (SML, PUSH). returns 0 on errors.
+// D0_PUSH keeps the data received after the last telegram, so calling d0_start_read again
+// from the callback gets every telegram, also back-to-back ones
+int d0_start_read(D0* d0);
+// handle port data and timeouts, returns the parser state
+enum d0_state d0_process(D0* d0);
+// abort a running readout, it finishes with D0_ERROR
+void d0_cancel(D0* d0);
+int d0_get_fd(D0* d0);
+// poll events for the port (POLLIN or 0)
+short d0_events(D0* d0);
+// milliseconds until d0_process has to be called, -1 if no readout is running
+int d0_timeout(D0* d0);
+// call cb with arg when a readout finished (NULL: no callback)
+void d0_set_callback(D0* d0, d0_callback cb, void * arg);
+
+// parser without i/o, e.g. for captured telegrams. d0_parse_reset clears all values
+// of the previous readout, d0_parse feeds len bytes and returns the resulting state.
+void d0_parse_reset(D0* d0);
+enum d0_state d0_parse(D0* d0, const char * buf, size_t len);
+
+#endif
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include "d0.h"
+
+// d0emu: IEC 62056-21 meter on a pseudo terminal, for tests and benchmarks without an optical head
+
+#define MAXREGS 1024
+
+static struct {
+	const char * ident;
+	const char * addr; // bus address for /?addr!, NULL: answer all requests
+	const char * link;
+	int fast; // don't emulate the transmission time
+	int nobaud; // ignore the baud rate switch
+	int noprog; // refuse programming mode
+	int noise, bcc, timeout; // percentage of readouts with a corrupted byte, wrong checksum, no answer
+	int push; // mode D: send a telegram every push ms without request
+	int verbose;
+} opt = { "/EMU5EMULATOR", NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static struct reg {
+	char * id;
+	char * val;
+	int counter; // increments with every readout
+} regs[MAXREGS];
+static int nregs;
+static unsigned long readouts;
+
+static int master, slave;
+
+static const int bauds[] = { 300, 600, 1200, 2400, 4800, 9600, 19200 };
+
+static void add_reg(const char * id, const char * val, int counter) {
+	if (nregs >= MAXREGS)
+		return;
+	regs[nregs].id = strdup(id);
+	regs[nregs].val = strdup(val);
+	regs[nregs].counter = counter;
+	++nregs;
+}
+
+// registers file: one id(value) per line
+static int read_regs(const char * file) {
+	FILE * fh = fopen(file, "r");
+	if (!fh) {
+		perror(file);
+		return 0;
+	}
+	char line[256];
+	while (fgets(line, sizeof(line), fh)) {
+		char * p = strchr(line, '(');
+		char * e = p ? strchr(p, ')') : NULL;
+		if (!e || line[0] == '#')
+			continue;
+		*p++ = 0;
+		*e = 0;
+		add_reg(line, p, 0);
+	}
+	fclose(fh);
+	return 1;
+}
+
+static int chance(int pct) {
+	return pct > 0 && rand() % 100 < pct;
+}
+
+// current baud rate of the port as set by the reader
+static int port_baud(void) {
+	struct termios tio;
+	if (tcgetattr(slave, &tio) < 0)
+		return 0;
+	speed_t speed = cfgetospeed(&tio);
+	const speed_t speeds[] = { B300, B600, B1200, B2400, B4800, B9600, B19200 };
+	for (int i=0; i<DIM(speeds); ++i)
+		if (speeds[i] == speed)
+			return bauds[i];
+	return 0;
+}
+
+// send at baud, in chunks of 100 ms transmission time. if the reader uses another
+// baud rate, it gets garbage like with a real line
+static void tx(const char * buf, size_t len, int baud) {
+	char garbage[len];
+	if (port_baud() != baud) {
+		for (size_t i=0; i<len; ++i)
+			garbage[i] = rand();
+		buf = garbage;
+	}
+	size_t chunk = opt.fast ? len : baud / 100;
+	for (size_t i=0; i<len; i+=chunk) {
+		size_t n = len-i < chunk ? len-i : chunk;
+		if (!opt.fast)
+			usleep(n * 10 * 1000000 / baud);
+		if (write(master, buf+i, n) < 0)
+			perror("write");
+	}
+}
+
+// message with block check character: [SOH/STX] data ETX BCC
+static void txmsg(char start, const char * data, int baud) {
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf)-1, "%c%s%c", start, data, ETX);
+	unsigned char bcc = 0;
+	for (int i=1; i<len; ++i)
+		bcc ^= buf[i];
+	buf[len++] = bcc;
+	tx(buf, len, baud);
+}
+
+static void readout(int baud) {
+	static char buf[MAXREGS*64];
+	static int warned;
+	const size_t size = sizeof(buf) - 8; // room for the end of the telegram
+	size_t len = 0;
+	if (opt.push) // mode D: identification, empty line, data without STX/ETX/BCC
+		len += snprintf(buf, size, "%.40s\r\n\r\n", opt.ident);
+	else
+		buf[len++] = STX;
+	for (int i=0; i<nregs; ++i) {
+		struct reg * r = &regs[i];
+		int n;
+		if (r->counter)
+			n = snprintf(buf+len, size-len, "%s(%06lu.%d*kWh)\r\n", r->id, readouts/10, (int)(readouts%10));
+		else
+			n = snprintf(buf+len, size-len, "%s(%s)\r\n", r->id, r->val);
+		if (n < 0 || n >= size-len) { // full, the cut off line is overwritten by the end
+			if (!warned++)
+				fprintf(stderr, "readout too long, the last %d registers are left out\n", nregs-i);
+			break;
+		}
+		len += n;
+	}
+	if (opt.push) {
+		len += sprintf(buf+len, "!\r\n");
+		if (chance(opt.noise))
+			buf[1 + rand() % (len-2)] ^= 1 << (rand() % 7);
+		if (chance(opt.timeout)) // cut off
+			len /= 2;
+		tx(buf, len, baud);
+		return;
+	}
+	len += sprintf(buf+len, "!\r\n%c", ETX);
+	unsigned char bcc = 0;
+	for (size_t i=1; i<len; ++i)
+		bcc ^= buf[i];
+	buf[len++] = chance(opt.bcc) ? bcc ^ 0x55 : bcc;
+	if (chance(opt.noise))
+		buf[1 + rand() % (len-2)] ^= 1 << (rand() % 7);
+	tx(buf, len, baud);
+}
+
+// answer to a programming mode read command for id
+static void read_reg(const char * id, int baud) {
+	char data[128];
+	snprintf(data, sizeof(data), "(ERROR)");
+	for (int i=0; i<nregs; ++i) {
+		struct reg * r = &regs[i];
+		if (strcmp(r->id, id))
+			continue;
+		if (r->counter)
+			snprintf(data, sizeof(data), "(%06lu.%d*kWh)", readouts/10, (int)(readouts%10));
+		else
+			snprintf(data, sizeof(data), "(%.100s)", r->val);
+		break;
+	}
+	txmsg(STX, data, baud);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: d0emu [options]\n"
+		"  -i <ident>  identification, the 5th char is the highest baud rate (default /EMU5EMULATOR)\n"
+		"  -s <serial> serial number (default 12345678)\n"
+		"  -r <file>   registers, one id(value) per line\n"
+		"  -R <n>      add n generated counter registers\n"
+		"  -a <addr>   bus address, only answer /?<addr>! (and /?!)\n"
+		"  -l <path>   symlink to the pty\n"
+		"  -f          fast, don't emulate the transmission time (except the ack)\n"
+		"  -B          ignore the baud rate switch (always 300 baud)\n"
+		"  -P          no programming mode\n"
+		"  -n <pct>    corrupt a byte in pct percent of the readouts\n"
+		"  -c <pct>    wrong checksum in pct percent of the readouts\n"
+		"  -t <pct>    don't answer pct percent of the requests (cut off push telegrams)\n"
+		"  -D <ms>     mode D, push a telegram every ms milliseconds at 2400 baud\n"
+		"  -S <seed>   random seed\n"
+		"  -v          verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char * argv[]) {
+	const char * serial = "12345678";
+	int gen = 0, o;
+	while ((o = getopt(argc, argv, "i:s:r:R:a:l:fBPn:c:t:D:S:v")) != -1) {
+		switch (o) {
+		case 'i': opt.ident = optarg; break;
+		case 's': serial = optarg; break;
+		case 'r': if (!read_regs(optarg)) exit(EXIT_FAILURE); break;
+		case 'R': gen = atoi(optarg); break;
+		case 'a': opt.addr = optarg; break;
+		case 'l': opt.link = optarg; break;
+		case 'f': opt.fast = 1; break;
+		case 'B': opt.nobaud = 1; break;
+		case 'P': opt.noprog = 1; break;
+		case 'n': opt.noise = atoi(optarg); break;
+		case 'c': opt.bcc = atoi(optarg); break;
+		case 't': opt.timeout = atoi(optarg); break;
+		case 'D': opt.push = atoi(optarg); break;
+		case 'S': srand(atoi(optarg)); break;
+		case 'v': opt.verbose = 1; break;
+		default: usage();
+		}
+	}
+	if (strlen(opt.ident) < 5)
+		usage();
+	if (nregs == 0) {
+		add_reg("0-0:C.1.0*255", serial, 0);
+		add_reg("1-0:1.8.0*255", "", 1);
+		add_reg("1-0:2.8.0*255", "000000.0*kWh", 0);
+	}
+	for (int i=0; i<gen; ++i) {
+		char id[32];
+		snprintf(id, sizeof(id), "1-0:%d.8.%d*255", 1 + i/10, i%10);
+		add_reg(id, "", 1);
+	}
+
+	if ((master = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("pty");
+		exit(EXIT_FAILURE);
+	}
+	const char * pts = ptsname(master);
+	// keep the slave open, so the master doesn't get EIO while no reader is connected
+	if ((slave = open(pts, O_RDWR|O_NOCTTY)) < 0) {
+		perror(pts);
+		exit(EXIT_FAILURE);
+	}
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	cfsetspeed(&tio, B300);
+	tcsetattr(slave, TCSANOW, &tio);
+	if (opt.link) {
+		unlink(opt.link);
+		if (symlink(pts, opt.link) < 0)
+			perror(opt.link);
+	}
+	printf("%s\n", pts);
+	fflush(stdout);
+
+	if (opt.push > 0) {
+		// mode D meters don't listen, send at the push rate of the line
+		while (1) {
+			usleep(opt.push * 1000);
+			readout(2400);
+			++readouts;
+		}
+	}
+
+	int z = opt.ident[4] - '0'; // announced baud rate
+	if (z < 0 || z >= DIM(bauds))
+		z = 0;
+	char in[256];
+	size_t len = 0;
+	int baud = 300; // of the current answer
+	while (1) {
+		ssize_t got = read(master, in+len, sizeof(in)-1-len);
+		if (got <= 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		len += got;
+		in[len] = 0;
+		char * p;
+		// sign on /?! or /?addr!
+		if ((p = strstr(in, "/?")) && strstr(p, "!\r\n")) {
+			char * e = strstr(p, "!\r\n");
+			*e = 0;
+			int mine = !p[2] || !opt.addr || !strcmp(p+2, opt.addr);
+			len = 0;
+			if (!mine)
+				continue;
+			baud = 300;
+			if (chance(opt.timeout)) {
+				if (opt.verbose)
+					fprintf(stderr, "sign on: no answer\n");
+				continue;
+			}
+			usleep(opt.fast ? 0 : 200000); // reaction time
+			char ident[64];
+			int n = snprintf(ident, sizeof(ident), "%s\r\n", opt.ident);
+			tx(ident, n, baud);
+		// ack with option select
+		} else if ((p = memchr(in, ACK, len)) && len - (p-in) >= 6 && p[4] == '\r') {
+			int zz = p[2] - '0', mode = p[3];
+			len = 0;
+			if (!opt.nobaud && zz > 0 && zz <= z)
+				baud = bauds[zz];
+			if (opt.verbose)
+				fprintf(stderr, "ack baud %d mode %c\n", baud, mode);
+			// the ack takes 200 ms at 300 baud on a real line, the reader switches after it is
+			// sent. so wait for that even in fast mode, then the reaction time
+			usleep(6 * 10 * 1000000 / 300 + (opt.fast ? 20000 : 200000));
+			if (mode == '1') {
+				if (opt.noprog) {
+					tx("\025", 1, baud);
+				} else {
+					char msg[64];
+					snprintf(msg, sizeof(msg), "P0%c(%s)", STX, serial);
+					txmsg(SOH, msg, baud);
+				}
+			} else {
+				readout(baud);
+				++readouts;
+			}
+		// programming mode command SOH cmd [STX data] ETX BCC
+		} else if ((p = memchr(in, SOH, len)) && (p = memchr(p, ETX, len - (p-in))) && p+1 < in+len) {
+			char * cmd = memchr(in, SOH, len) + 1;
+			*p = 0;
+			len = 0;
+			if (!strncmp(cmd, "B0", 2)) {
+				++readouts;
+				continue;
+			}
+			char * data = strchr(cmd, STX);
+			if (!strncmp(cmd, "R5", 2) && data && (p = strstr(data, "()"))) {
+				*p = 0;
+				read_reg(data+1, baud);
+			} else {
+				tx("\025", 1, baud); // unknown command
+			}
+		} else if (len >= sizeof(in)-1) {
+			len = 0; // garbage
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef D0PRIV_H
+#define D0PRIV_H
+
+// libd0 internals for the protocol parsers, not part of the interface in d0.h
+
+#include "d0.h"
+
+// elements of an array, doesn't compile for pointers like d0->val
+#undef DIM
+#define DIM(vec) (sizeof(vec)/sizeof(vec[0]) + 0*sizeof(struct { int _array:1-2*__builtin_types_compatible_p(__typeof__(vec), __typeof__(&(vec)[0])); }))
+
+// register storage: d0_val_new returns a cleared slot after the last register (count it in
+// vals when it is complete), d0_alloc string space. both return NULL if out of memory
+struct d0val * d0_val_new(D0* d0);
+char * d0_alloc(D0* d0, size_t size);
+// set tsms to the receive time of the byte that is followed by after more bytes of the last
+// read (the read time minus their transmission time at 10 bits per byte)
+void d0_stamp(D0* d0, size_t after);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "d0snap.h"
+
+// d0query: print the latest readouts from the snapshot of d0vz, without touching the serial ports
+
+static void usage(void) {
+	fprintf(stderr, "usage: d0query [-f <snapshot>] [<serial> [<obis>...]]\n"
+		"  without a serial all meters are listed, with obis ids only their values are printed\n"
+		"  -f <file>   snapshot file (default " D0SNAP_PATH ")\n");
+	exit(EXIT_FAILURE);
+}
+
+static double age(uint64_t tsms, uint64_t now) {
+	return tsms < now ? (now - tsms) / 1000.0 : 0;
+}
+
+static void print_meter(const struct d0snap_meter * m, uint64_t now) {
+	printf("%s %s%s%s %s readout %lu, %.1f s ago\n", *m->serial ? m->serial : "-", m->port, *m->addr ? " address " : "", m->addr,
+		m->id, (unsigned long) m->readouts, age(m->tsms, now));
+	for (int i=0; i<m->vals; ++i) {
+		const struct d0snap_val * v = &m->val[i];
+		char obis[32];
+		printf("  %-16s %s%s%s  (changed %.1f s ago)\n", v->obis ? d0_obis_format(v->obis, obis, sizeof(obis)) : v->id,
+			v->val, *v->unit ? " " : "", v->unit, age(v->tsms, now));
+	}
+}
+
+int main(int argc, char * argv[]) {
+	const char * path = D0SNAP_PATH;
+	int o;
+	while ((o = getopt(argc, argv, "f:")) != -1) {
+		switch (o) {
+		case 'f': path = optarg; break;
+		default: usage();
+		}
+	}
+	const char * serial = optind < argc ? argv[optind++] : NULL;
+	struct d0snap * snap = d0snap_open(path, 0);
+	if (!snap) {
+		fprintf(stderr, "%s: %s\n", path, errno == EPROTO ? "no d0vz snapshot" : strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	uint64_t now = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	static struct d0snap_meter m;
+	int found = 0, ret = EXIT_SUCCESS;
+	for (int i=0; i<D0SNAP_METERS; ++i) {
+		int rc = d0snap_read(snap, i, &m);
+		if (rc < 0) {
+			fprintf(stderr, "meter slot %d is locked, d0vz died while writing it?\n", i);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if (!rc || (serial && strcmp(m.serial, serial)))
+			continue;
+		found = 1;
+		if (optind == argc) {
+			print_meter(&m, now);
+			continue;
+		}
+		// values of the given registers, one per line
+		for (int a=optind; a<argc; ++a) {
+			uint64_t obis;
+			int j;
+			if (!d0_obis_parse(argv[a], &obis)) {
+				fprintf(stderr, "invalid obis id %s\n", argv[a]);
+				exit(EXIT_FAILURE);
+			}
+			for (j=0; j<m.vals && m.val[j].obis != obis; ++j) { }
+			if (j < m.vals) {
+				printf("%s%s%s\n", m.val[j].val, *m.val[j].unit ? " " : "", m.val[j].unit);
+			} else {
+				fprintf(stderr, "%s: no register %s\n", serial, argv[a]);
+				ret = EXIT_FAILURE;
+			}
+		}
+		break;
+	}
+	d0snap_close(snap);
+	if (serial && !found) {
+		fprintf(stderr, "no meter %s\n", serial);
+		ret = EXIT_FAILURE;
+	}
+	return ret;
+}
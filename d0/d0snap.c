@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "d0snap.h"
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void copy(char * dst, const char * src, size_t size) {
+	snprintf(dst, size, "%s", src ? src : "");
+}
+
+struct d0snap * d0snap_open(const char * path, int writer) {
+	struct d0snap * snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+	snap->writer = writer;
+	if (writer) {
+		// build the new file beside the old one and rename it, so readers that still
+		// map the old file don't see it being truncated
+		char tmp[strlen(path) + 5];
+		sprintf(tmp, "%s.new", path);
+		snap->fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if (snap->fd < 0)
+			goto fail;
+		if (ftruncate(snap->fd, sizeof(struct d0snap_file)) < 0 || rename(tmp, path) < 0) {
+			unlink(tmp);
+			goto fail;
+		}
+	} else {
+		struct stat st;
+		snap->fd = open(path, O_RDONLY);
+		if (snap->fd < 0)
+			goto fail;
+		if (fstat(snap->fd, &st) < 0)
+			goto fail;
+		if (st.st_size != sizeof(struct d0snap_file)) {
+			errno = EPROTO;
+			goto fail;
+		}
+	}
+	snap->file = mmap(NULL, sizeof(struct d0snap_file), writer ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, snap->fd, 0);
+	if (snap->file == MAP_FAILED) {
+		snap->file = NULL;
+		goto fail;
+	}
+	if (writer) {
+		snap->file->meters = D0SNAP_METERS;
+		snap->file->vals = D0SNAP_VALS;
+		snap->file->version = D0SNAP_VERSION;
+		__atomic_store_n(&snap->file->magic, D0SNAP_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&snap->file->magic, __ATOMIC_ACQUIRE) != D0SNAP_MAGIC || snap->file->version != D0SNAP_VERSION) {
+		errno = EPROTO;
+		goto fail;
+	}
+	return snap;
+
+fail: {
+		int err = errno;
+		d0snap_close(snap);
+		errno = err;
+		return NULL;
+	}
+}
+
+void d0snap_close(struct d0snap * snap) {
+	if (!snap)
+		return;
+	if (snap->file)
+		munmap(snap->file, sizeof(struct d0snap_file));
+	if (snap->fd >= 0)
+		close(snap->fd);
+	free(snap);
+}
+
+// whether slot s is the one of the meter read by d0 at port
+static int same_meter(const struct d0snap_meter * s, const D0 * d0, const char * port) {
+	if (d0->serial[0])
+		return !strcmp(s->serial, d0->serial);
+	// without a serial the meter is known by where it is
+	return !s->serial[0] && !strncmp(s->port, port, sizeof(s->port)-1) && !strcmp(s->addr, d0->_addr);
+}
+
+int d0snap_publish(struct d0snap * snap, const D0 * d0, const char * port, uint64_t tsms) {
+	struct d0snap_file * f = snap->file;
+	struct d0snap_meter * m = NULL;
+	// slot of the meter, or the first free one
+	for (int i=0; i<D0SNAP_METERS; ++i) {
+		struct d0snap_meter * s = &f->meter[i];
+		if (s->tsms && same_meter(s, d0, port)) {
+			m = s;
+			break;
+		}
+		if (!s->tsms && !m)
+			m = s;
+	}
+	if (!m)
+		return 0;
+
+	uint32_t seq = m->seq;
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	copy(m->serial, d0->serial, sizeof(m->serial));
+	copy(m->id, d0->id, sizeof(m->id));
+	copy(m->port, port, sizeof(m->port));
+	copy(m->addr, d0->_addr, sizeof(m->addr));
+	int n = d0->vals < D0SNAP_VALS ? d0->vals : D0SNAP_VALS;
+	for (int i=0; i<n; ++i) {
+		const struct d0val * v = &d0->val[i];
+		struct d0snap_val * sv = &m->val[i];
+		// keep the change time if the register is the same as before and didn't change
+		int same = i < m->vals && sv->obis == v->obis && !strncmp(sv->id, v->id, sizeof(sv->id)-1);
+		if (!same || strncmp(sv->val, v->val, sizeof(sv->val)-1) || strncmp(sv->unit, v->unit ? v->unit : "", sizeof(sv->unit)-1))
+			sv->tsms = tsms;
+		sv->obis = v->obis;
+		copy(sv->id, v->id, sizeof(sv->id));
+		copy(sv->val, v->val, sizeof(sv->val));
+		copy(sv->unit, v->unit, sizeof(sv->unit));
+	}
+	m->vals = n;
+	m->tsms = tsms;
+	++m->readouts;
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int d0snap_read(const struct d0snap * snap, int i, struct d0snap_meter * meter) {
+	const struct d0snap_meter * m = &snap->file->meter[i];
+	uint32_t seq, again;
+	long long locked = 0;
+	do {
+		while ((seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE)) & 1) {
+			if (!locked)
+				locked = now_ms() + D0SNAP_LOCKED_MS;
+			else if (now_ms() > locked)
+				return -1;
+			sched_yield(); // writer busy
+		}
+		memcpy(meter, m, sizeof(*meter));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		again = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+	} while (seq != again);
+	return meter->tsms != 0;
+}
@@ -0,0 +1,61 @@
+#ifndef D0SNAP_H
+#define D0SNAP_H
+
+#include <stdint.h>
+#include "d0.h"
+
+// snapshot of the latest readout of each meter in a shared memory file. d0vz writes it,
+// any number of local readers get consistent copies without locking (seqlock per meter)
+
+#define D0SNAP_PATH "/dev/shm/d0vz.snap"
+#define D0SNAP_MAGIC 0x64307370 // "d0sp"
+#define D0SNAP_VERSION 2
+#define D0SNAP_METERS 32
+#define D0SNAP_VALS 256
+// a slot that is being written longer than this (ms) is locked by a writer that died
+#define D0SNAP_LOCKED_MS 1000
+
+struct d0snap_val {
+	uint64_t obis; // 0 if the id is no OBIS code
+	uint64_t tsms; // time of the last change (ms since epoch)
+	char id[24];
+	char val[32];
+	char unit[16];
+};
+
+struct d0snap_meter {
+	uint32_t seq; // odd while the writer updates the meter
+	int32_t vals;
+	uint64_t tsms; // time of the readout (ms since epoch), 0 if the slot is unused
+	uint64_t readouts;
+	char serial[16];
+	char id[32];
+	char port[64];
+	char addr[D0_ADDRLEN+1]; // bus address, the slot of meters without a serial is port and address
+	struct d0snap_val val[D0SNAP_VALS];
+};
+
+struct d0snap_file {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t meters;
+	uint32_t vals;
+	struct d0snap_meter meter[D0SNAP_METERS];
+};
+
+struct d0snap {
+	int fd;
+	int writer;
+	struct d0snap_file * file;
+};
+
+// create a new snapshot file (writer) or map an existing one read only, NULL on errors (see errno)
+struct d0snap * d0snap_open(const char * path, int writer);
+void d0snap_close(struct d0snap * snap);
+// store the values of a completed readout of port, returns 0 if all meter slots are in use
+int d0snap_publish(struct d0snap * snap, const D0 * d0, const char * port, uint64_t tsms);
+// consistent copy of meter slot i, returns 0 if it is unused, -1 if it stays locked (the writer
+// died while updating it)
+int d0snap_read(const struct d0snap * snap, int i, struct d0snap_meter * meter);
+
+#endif
@@ -1,25 +1,169 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
 #include "d0.h"
 
+// parse a captured telegram (identification line and data block) <count> times
+static int parsetest(const char * file, int count, enum d0_proto proto) {
+	static char buf[64*1024];
+	FILE * fh = fopen(file, "r");
+	if (fh == NULL) {
+		perror(file);
+		return 1;
+	}
+	size_t len = fread(buf, 1, sizeof(buf), fh);
+	fclose(fh);
+
+	D0 * d0 = d0_open(NULL);
+	d0_set_protocol(d0, proto);
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (int i=0; i<count; ++i) {
+		d0_parse_reset(d0);
+		if (d0_parse(d0, buf, len) != D0_DONE) {
+			printf("parse error: %s\n", d0->errstr);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double dur = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	d0_dump(d0);
+	printf("%d x %zu bytes in %.3f s: %.0f telegrams/s, %.1f MB/s\n", count, len, dur, count / dur, count * len / dur / 1e6);
+	d0_close(d0);
+	return 0;
+}
+
+static void done(D0 * d0, enum d0_state state, void * arg) {
+	const char * dev = arg;
+	if (state == D0_DONE) {
+		printf("%s: got %d values\n", dev, d0->vals);
+		d0_dump(d0);
+	} else {
+		printf("%s: error: %s\n", dev, d0->errstr);
+	}
+}
+
+// read all devices at the same time with the non-blocking api
+static int asynctest(char ** devs, int n, enum d0_proto proto) {
+	D0 * d0[n];
+	struct pollfd fds[n];
+	for (int i=0; i<n; ++i) {
+		if ((d0[i] = d0_open(devs[i])) == NULL) {
+			perror(devs[i]);
+			return 1;
+		}
+		d0_set_protocol(d0[i], proto);
+		d0_set_callback(d0[i], done, devs[i]);
+		if (!d0_start_read(d0[i]))
+			printf("%s: start error: %s\n", devs[i], d0[i]->errstr);
+	}
+	int running;
+	do {
+		int timeout = -1;
+		running = 0;
+		for (int i=0; i<n; ++i) {
+			int t = d0_timeout(d0[i]);
+			fds[i].fd = d0_get_fd(d0[i]);
+			fds[i].events = d0_events(d0[i]);
+			if (t >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+			if (t >= 0)
+				++running;
+		}
+		if (running == 0)
+			break;
+		poll(fds, n, timeout);
+		for (int i=0; i<n; ++i)
+			if (fds[i].revents || d0_timeout(d0[i]) == 0)
+				d0_process(d0[i]);
+	} while (1);
+	for (int i=0; i<n; ++i)
+		d0_close(d0[i]);
+	return 0;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// read dev for secs seconds (e.g. against d0emu): readouts/s, system calls per readout and
+// the recovery time from the first failed readout to the next good one
+static int benchtest(const char * dev, double secs, enum d0_proto proto) {
+	D0 * d0 = d0_open(dev);
+	if (d0 == NULL) {
+		perror(dev);
+		return 1;
+	}
+	d0_set_protocol(d0, proto);
+	double start = now(), failed = 0, recovery = 0, maxrecovery = 0;
+	int recoveries = 0;
+	while (now() - start < secs) {
+		if (d0_read(d0)) {
+			if (failed > 0) {
+				double t = now() - failed;
+				recovery += t;
+				if (t > maxrecovery)
+					maxrecovery = t;
+				++recoveries;
+				failed = 0;
+			}
+		} else if (failed == 0) {
+			failed = now();
+		}
+	}
+	double dur = now() - start;
+	struct d0stats * st = &d0->stats;
+	unsigned long n = st->readouts ? st->readouts : 1;
+	printf("%lu readouts (%lu errors) in %.1f s: %.2f readouts/s, %d values, %d baud\n",
+		st->readouts, st->errors, dur, st->readouts / dur, d0->vals, d0->baud);
+	printf("per readout: %.1f reads, %.1f writes, %.1f ioctls, %.1f polls\n",
+		(double)st->reads / n, (double)st->writes / n, (double)st->ioctls / n, (double)st->polls / n);
+	if (recoveries)
+		printf("recovery after errors: %d times, avg %.0f ms, max %.0f ms\n", recoveries, recovery / recoveries * 1000, maxrecovery * 1000);
+	d0_close(d0);
+	return 0;
+}
+
 int main(int argc, char * argv[]) {
+	enum d0_proto proto = D0_IEC;
+	if (argc > 1 && (!strcmp(argv[1], "-s") || !strcmp(argv[1], "-D"))) {
+		proto = argv[1][1] == 's' ? D0_SML : D0_PUSH;
+		--argc;
+		++argv;
+	}
 	if (argc<2) {
-		fprintf(stderr, "usage: %s <device>\n", argv[0]);
+		fprintf(stderr, "usage: d0test [-s|-D] <device>\n");
+		fprintf(stderr, "       d0test [-s|-D] -p <telegram file> [<count>]\n");
+		fprintf(stderr, "       d0test [-s|-D] -a <device>...  read all devices at once (non-blocking api)\n");
+		fprintf(stderr, "       d0test [-s|-D] -b <seconds> <device>  benchmark, e.g. against d0emu\n");
+		fprintf(stderr, "  -s  SML instead of IEC 62056-21 mode C\n");
+		fprintf(stderr, "  -D  listen for IEC 62056-21 mode D push telegrams at %d baud (e.g. d0emu -D)\n", D0_PUSH_BAUD);
 		exit(1);
 	}
+	if (!strcmp(argv[1], "-p") && argc > 2)
+		return parsetest(argv[2], argc > 3 ? atoi(argv[3]) : 1, proto);
+	if (!strcmp(argv[1], "-b") && argc > 3)
+		return benchtest(argv[3], atof(argv[2]), proto);
+	if (!strcmp(argv[1], "-a") && argc > 2)
+		return asynctest(argv+2, argc-2, proto);
+
 	char * dev = argv[1];
 	printf("open device %s\n", dev);
-	D0 * d0 = d0_open(dev, 300);
+	D0 * d0 = d0_open(dev);
 	if (d0 == NULL) {
 		perror("d0_init");
 		exit(1);
 	}
+	d0_set_protocol(d0, proto);
 	if (d0_read(d0)) {
 		printf("d0_read got %d values\n", d0->vals);
 		d0_dump(d0);
 	} else {
-		printf("d0_read error\n");
+		printf("d0_read error: %s\n", d0->errstr);
 	}
 	d0_close(d0);
 }
-
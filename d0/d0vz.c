@@ -8,15 +8,17 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
 #include <signal.h>
 #include <fcntl.h>
 #include "d0.h"
+#include "d0snap.h"
 #include "d0vz.h"
 #include "d0vz_ts.h"
 
 // config is global
 static struct config_t conf;
+static struct d0snap * snap;
 
 
 void mylog(char *fmt, ...)
@@ -69,6 +71,53 @@ void * myalloc(size_t size) {
 	exit(EXIT_FAILURE);
 }
 
+// parse a decimal number like 000123.40 into a fixed point value, returns 0 if s is no number
+int fixed_parse(const char * s, struct fixed * f) {
+	int digits = 0, any = 0, neg = (*s == '-');
+	f->v = 0;
+	f->scale = -1; // no decimal point yet
+	for (s += neg || *s == '+'; *s; ++s) {
+		if (*s == '.' && f->scale < 0) {
+			f->scale = 0;
+		} else if (*s >= '0' && *s <= '9' && digits < 18) {
+			f->v = f->v * 10 + (*s - '0');
+			any = 1;
+			if (f->v)
+				++digits;
+			if (f->scale >= 0)
+				++f->scale;
+		} else {
+			return 0;
+		}
+	}
+	if (f->scale < 0)
+		f->scale = 0;
+	if (neg)
+		f->v = -f->v;
+	return any;
+}
+
+// value of f with scale decimals (scale >= f.scale)
+static int64_t fixed_at(struct fixed f, int scale) {
+	for (int i=f.scale; i<scale; ++i)
+		f.v *= 10;
+	return f.v;
+}
+
+// is val outside of the deadband around the last posted value?
+static int fixed_changed(struct channel_t * ch, struct fixed val) {
+	int scale = val.scale > ch->last.scale ? val.scale : ch->last.scale;
+	if (!ch->relative && ch->deadband.scale > scale)
+		scale = ch->deadband.scale;
+	int64_t last = fixed_at(ch->last, scale);
+	int64_t diff = fixed_at(val, scale) - last;
+	if (diff < 0)
+		diff = -diff;
+	if (ch->relative) // deadband in percent of the last value
+		return diff > 0 && diff * 100.0 > (double)ch->deadband.v * (last < 0 ? -last : last) / fixed_at((struct fixed){1, 0}, ch->deadband.scale);
+	return diff > fixed_at(ch->deadband, scale);
+}
+
 const char * CONF_SEP = " \r\n";
 #define CONFIG_ELEM(c,dest) ((c=strtok(NULL,CONF_SEP)) && (dest=strdup(c)))
 struct config_t * read_config(const char * conffile, struct config_t * conf) {
@@ -99,11 +148,29 @@ struct config_t * read_config(const char * conffile, struct config_t * conf) {
 			if (CONFIG_ELEM(c, conf->spool)) {
 				DPRINT("line %d: spool to '%s'", lines, conf->spool);
 			}
-		// port /dev/serial/by-id/usb-FTDI_FT232R_USB_UART_xxxxxxxx-if00-port0
+		} else if (!strcmp(c, "snapshot")) {
+			if (!CONFIG_ELEM(c, conf->snapshot))
+				conf->snapshot = D0SNAP_PATH;
+			DPRINT("line %d: snapshot to '%s'", lines, conf->snapshot);
+		// port /dev/serial/by-id/usb-FTDI_FT232R_USB_UART_xxxxxxxx-if00-port0 [9600] [sml|push] [select] [timeout <s>]
 		} else if (!strcmp(c, "port")) {
 			struct port_t * po = myalloc(sizeof(struct port_t));
 			if (CONFIG_ELEM(c, po->path)) {
-				DPRINT("line %d: port %d is '%s'", lines, ports, c);
+				while ((c = strtok(NULL, CONF_SEP))) {
+					if (!strcmp(c, "sml"))
+						po->sml = 1;
+					else if (!strcmp(c, "push"))
+						po->push = 1;
+					else if (!strcmp(c, "select"))
+						po->select = 1;
+					else if (!strcmp(c, "timeout")) {
+						char * arg = strtok(NULL, CONF_SEP);
+						if (!arg || (po->timeout = atof(arg) * 1000) <= 0)
+							mylog("line %d: invalid port timeout", lines);
+					} else if ((po->maxbaud = atoi(c)) <= 0)
+						mylog("line %d: invalid port option '%s'", lines, c);
+				}
+				DPRINT("line %d: port %d is '%s' maxbaud %d sml %d push %d select %d timeout %d", lines, ports, po->path, po->maxbaud, po->sml, po->push, po->select, po->timeout);
 				*po0 = po;
 				po0 = &po->next;
 				++ports;
@@ -111,12 +178,37 @@ struct config_t * read_config(const char * conffile, struct config_t * conf) {
 				free(po->path);
 				free(po);
 			}
-		// device 0-0:C.1.0*255 12345
+		// device 0-0:C.1.0*255 12345 [<interval>] [adaptive <min interval>] [port <path> [address <addr>] [priority <n>]]
 		} else if (!strcmp(c, "device")) {
 			struct device_t * dev = myalloc(sizeof(struct device_t));
 			if (CONFIG_ELEM(c, dev->oid) && CONFIG_ELEM(c, dev->serial)) {
 				// TODO? dupecheck
-				DPRINT("line %d: device %d oid %s serial %s", lines, devices, dev->oid, dev->serial);
+				dev->interval = DEFAULT_INTERVAL;
+				while ((c = strtok(NULL, CONF_SEP))) {
+					char * arg = NULL;
+					if (!strcmp(c, "adaptive") || !strcmp(c, "port") || !strcmp(c, "address") || !strcmp(c, "priority")) {
+						if (!(arg = strtok(NULL, CONF_SEP))) {
+							mylog("line %d: device option '%s' without value", lines, c);
+							break;
+						}
+					}
+					if (!strcmp(c, "adaptive") && atof(arg) > 0)
+						dev->min_interval = atof(arg) * 1000;
+					else if (!strcmp(c, "port"))
+						dev->port = strdup(arg);
+					else if (!strcmp(c, "address"))
+						dev->address = strdup(arg);
+					else if (!strcmp(c, "priority"))
+						dev->priority = atoi(arg);
+					else if (!arg && atof(c) > 0)
+						dev->interval = atof(c) * 1000;
+					else
+						mylog("line %d: invalid device option '%s'", lines, c);
+				}
+				if (dev->min_interval > dev->interval)
+					dev->min_interval = dev->interval;
+				dev->cur_interval = dev->interval;
+				DPRINT("line %d: device %d oid %s serial %s interval %d min %d", lines, devices, dev->oid, dev->serial, dev->interval, dev->min_interval);
 				*dev0 = dev;
 				dev0 = &dev->next;
 				ch0 = &dev->channel;
@@ -125,15 +217,36 @@ struct config_t * read_config(const char * conffile, struct config_t * conf) {
 				mylog("line %d: add device failed", lines);
 				// free(...)
 			}
-		// channel 1-0:1.8.0*255 aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee
+		// channel 1-0:1.8.0*255 aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee [deadband <abs>|<pct>%] [min <s>] [max <s>]
 		} else if (!strcmp(c, "channel")) {
 			if (!ch0) {
 				mylog("line %d: channel without device", lines);
 				continue;
 			}
 			struct channel_t * ch = myalloc(sizeof(struct channel_t));
-			if (CONFIG_ELEM(c, ch->oid) && CONFIG_ELEM(c, ch->uuid)) {
-				DPRINT("line %d: channel %d oid %s uuid %s", lines, channels, ch->oid, ch->uuid);
+			size_t n;
+			if (CONFIG_ELEM(c, ch->oid) && CONFIG_ELEM(c, ch->uuid) &&
+			    (n = d0_obis_parse(ch->oid, &ch->obis)) > 0 && !ch->oid[n]) {
+				while ((c = strtok(NULL, CONF_SEP))) {
+					char * arg = strtok(NULL, CONF_SEP);
+					if (!arg) {
+						mylog("line %d: channel option '%s' without value", lines, c);
+					} else if (!strcmp(c, "deadband")) {
+						size_t len = strlen(arg);
+						if ((ch->relative = (arg[len-1] == '%')))
+							arg[len-1] = 0;
+						if (!fixed_parse(arg, &ch->deadband) || ch->deadband.v < 0)
+							mylog("line %d: invalid deadband '%s'", lines, arg);
+					} else if (!strcmp(c, "min")) {
+						ch->min_post = atof(arg) * 1000;
+					} else if (!strcmp(c, "max")) {
+						ch->max_post = atof(arg) * 1000;
+					} else {
+						mylog("line %d: invalid channel option '%s'", lines, c);
+					}
+				}
+				DPRINT("line %d: channel %d oid %s uuid %s deadband %lld/%d%s min %d max %d", lines, channels, ch->oid, ch->uuid,
+					(long long)ch->deadband.v, ch->deadband.scale, ch->relative ? "%" : "", ch->min_post, ch->max_post);
 				*ch0 = ch;
 				ch0 = &ch->next;
 				++channels;
@@ -163,104 +276,387 @@ void vzspool(unsigned long long tsms, char * uuid, char * val) {
 	}
 }
 
-int d0read(D0 * d0) {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	unsigned long long tsms = (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	if (!d0_read(d0)) {
-		mylog("d0_read: %s", d0->errstr);
-		return 0;
+// handle the values of a finished readout that started at tsms
+// channel lookup by device serial and obis code: open addressing with linear probing,
+// the table is built once after the config is read and at most half full
+struct chan_entry {
+	const char * serial;
+	uint64_t obis;
+	struct channel_t * ch;
+};
+static struct chan_entry * chan_tab;
+static size_t chan_mask;
+
+static size_t chan_hash(const char * serial, uint64_t obis) {
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	for (const char * c=serial; *c; ++c)
+		h = (h ^ (unsigned char)*c) * 1099511628211ull;
+	for (int i=0; i<6; ++i, obis >>= 8)
+		h = (h ^ (obis & 0xff)) * 1099511628211ull;
+	return h ^ h >> 32;
+}
+
+void chan_build(void) {
+	size_t n = 0, size = 16;
+	for (struct device_t * dev=conf.device; dev; dev=dev->next)
+		for (struct channel_t * ch=dev->channel; ch; ch=ch->next)
+			++n;
+	while (size < 2*n)
+		size *= 2;
+	chan_tab = myalloc(size * sizeof(*chan_tab));
+	chan_mask = size - 1;
+	for (struct device_t * dev=conf.device; dev; dev=dev->next) {
+		for (struct channel_t * ch=dev->channel; ch; ch=ch->next) {
+			size_t i = chan_hash(dev->serial, ch->obis) & chan_mask;
+			while (chan_tab[i].ch && (chan_tab[i].obis != ch->obis || strcmp(chan_tab[i].serial, dev->serial)))
+				i = (i+1) & chan_mask;
+			if (chan_tab[i].ch) {
+				mylog("serial %s obis-id %s: duplicate channel, ignoring uuid %s", dev->serial, ch->oid, ch->uuid);
+				continue;
+			}
+			chan_tab[i] = (struct chan_entry){ dev->serial, ch->obis, ch };
+		}
+	}
+}
+
+struct channel_t * chan_find(const char * serial, uint64_t obis) {
+	for (size_t i = chan_hash(serial, obis) & chan_mask; chan_tab[i].ch; i = (i+1) & chan_mask)
+		if (chan_tab[i].obis == obis && !strcmp(chan_tab[i].serial, serial))
+			return chan_tab[i].ch;
+	return NULL;
+}
+
+// attach the devices configured with a port to it, these ports are multi-drop busses
+void bus_build(void) {
+	for (struct device_t * dev=conf.device; dev; dev=dev->next) {
+		if (!dev->port)
+			continue;
+		struct port_t * po;
+		for (po=conf.port; po && strcmp(po->path, dev->port); po=po->next) { }
+		if (!po) {
+			mylog("device %s: port %s is not configured", dev->serial, dev->port);
+			continue;
+		}
+		if (!dev->address)
+			dev->address = dev->serial;
+		if (strlen(dev->address) > D0_ADDRLEN) {
+			mylog("device %s: address %s too long", dev->serial, dev->address);
+			continue;
+		}
+		struct device_t ** devs = realloc(po->devs, (po->ndevs+1) * sizeof(*devs));
+		if (!devs) {
+			mylog("realloc failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		po->devs = devs;
+		po->devs[po->ndevs++] = dev;
 	}
+	for (struct port_t * po=conf.port; po; po=po->next)
+		if (po->ndevs)
+			mylog("port %s is a bus with %d meters", po->path, po->ndevs);
+}
+
+// libd0 register filter: only configured registers are stored (all until the serial is known)
+static int chan_filter(D0 * d0, uint64_t obis, void * arg) {
+	return !d0->serial[0] || chan_find(d0->serial, obis);
+}
+
+// handle the values of a finished readout that started at tsms, returns the number of changed values
+int d0values(D0 * d0, unsigned long long tsms) {
+	int changed = 0;
 	DPRINT("d0_read got %d values", d0->vals);
 #ifdef DEBUG
 	d0_dump(d0);
 #endif
 	
 	// find config channels for received values
-	for (struct device_t * dev=conf.device; dev; dev=dev->next) {
-		if (strcmp(dev->serial, d0->serial))
+	for (int i=0; i<d0->vals; ++i) {
+		struct d0val * val = &d0->val[i];
+		struct channel_t * ch = chan_find(d0->serial, val->obis);
+		if (!ch)
 			continue;
-		// found device
-		// TODO: micro optimization: put this device at the start of the device list
-		for (struct channel_t * ch=dev->channel; ch; ch=ch->next) {
-			for (int i=0; i<d0->vals; ++i) {
-				struct d0val val = d0->val[i];
-				if (strcmp(ch->oid, val.id))
-					continue;
-				// found channel
-				char * p = val.val;
-				// strip leading zeroes ...
-				for (p=val.val; *p == '0' ; ++p) { }
-				// ... but leave one if there's nothing else
-				if (p > val.val && (!*p || *p == '.'))
-					--p;
-				DPRINT("serial %s obis-id %s -> uuid %s val %s", dev->serial, ch->oid, ch->uuid, p);
-				if (strlen(p) < sizeof(ch->value)) {
-					if (*(ch->value) == 0) { // initial read
-						mylog("serial %s obis-id %s : initial value %s", dev->serial, ch->oid, p);
-					} else if (strcmp(ch->value, p)) {
-						mylog("serial %s obis-id %s : value change %s to %s", dev->serial, ch->oid, ch->value, p);
-						vzspool(tsms, ch->uuid, p);
-					}
-					strcpy(ch->value, p);
-				} else { // unlikely, but you never know...
-					mylog("ERROR: ignoring value, string too long (serial %s obis-id %s value %s)", dev->serial, ch->oid, p);
-					*(ch->value) = 0; // clear value
-				}
+		// found channel
+		char * p = val->val;
+		// strip leading zeroes ...
+		for (p=val->val; *p == '0' ; ++p) { }
+		// ... but leave one if there's nothing else
+		if (p > val->val && (!*p || *p == '.'))
+			--p;
+		DPRINT("serial %s obis-id %s -> uuid %s val %s", d0->serial, ch->oid, ch->uuid, p);
+		if (strlen(p) < sizeof(ch->value)) {
+			struct fixed fx;
+			int numeric = fixed_parse(p, &fx);
+			if (*(ch->value) == 0) { // initial read
+				mylog("serial %s obis-id %s : initial value %s", d0->serial, ch->oid, p);
+				strcpy(ch->value, p);
+				ch->numeric = numeric;
+				ch->last = fx;
+				ch->post_ts = tsms;
+				continue;
 			}
+			// numbers are compared with the deadband, other values as strings. value and last
+			// are the posted value, so slow changes add up until they are outside the deadband
+			int change = (numeric && ch->numeric) ? fixed_changed(ch, fx) : strcmp(ch->value, p) != 0;
+			unsigned long long since = tsms - ch->post_ts;
+			changed += change;
+			if ((change && since >= ch->min_post) || (ch->max_post > 0 && since >= ch->max_post)) {
+				if (change)
+					mylog("serial %s obis-id %s : value change %s to %s", d0->serial, ch->oid, ch->value, p);
+				vzspool(tsms, ch->uuid, p);
+				strcpy(ch->value, p);
+				ch->numeric = numeric;
+				ch->last = fx;
+				ch->post_ts = tsms;
+			}
+		} else { // unlikely, but you never know...
+			mylog("ERROR: ignoring value, string too long (serial %s obis-id %s value %s)", d0->serial, ch->oid, p);
+			*(ch->value) = 0; // clear value
 		}
 	}
-	return 1;
+	return changed;
 }
 
-void d0loop(char * port) {
-	while (1) {
-		D0 * d0 = d0_open(port);
-		if (!d0) {
-			mylog("d0_open failed (%s), retry in 10 seconds", strerror(errno));
-			sleep(10);
-			continue;
-		}
-		mylog("opened port device %s", port);
-		do {
-			sleep(2);
-		} while (d0read(d0));
-		mylog("d0read error, reopen port %s in 5 seconds", port);
-		d0_close(d0);
-		sleep(5);
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// wait for the port to become readable if the readout needs it. the fd is registered
+// EPOLLONESHOT, so it is re-armed only when needed and not while libd0 holds off
+static void port_arm(int epfd, struct port_t * po) {
+	if (po->armed || !(d0_events(po->d0) & POLLIN))
+		return;
+	struct epoll_event ev = { .events = EPOLLIN|EPOLLONESHOT, .data.ptr = po };
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, d0_get_fd(po->d0), &ev) == 0)
+		po->armed = 1;
+	else
+		mylog("epoll_ctl %s: %s", po->path, strerror(errno));
+}
+
+static void port_close(struct port_t * po, long long now) {
+	mylog("d0read error, reopen port %s in 5 seconds", po->path);
+	d0_close(po->d0); // also removes the fd from the epoll set
+	po->d0 = NULL;
+	po->state = PORT_CLOSED;
+	po->due = now + 5000;
+}
+
+// the configured device of the meter at the port, NULL if unknown
+static struct device_t * port_device(struct port_t * po) {
+	const char * serial = po->d0->serial;
+	if (po->dev && !strcmp(po->dev->serial, serial))
+		return po->dev;
+	for (po->dev=conf.device; po->dev; po->dev=po->dev->next)
+		if (!strcmp(po->dev->serial, serial))
+			break;
+	return po->dev;
+}
+
+// poll interval of dev after a readout. adaptive devices halve the interval while values
+// change and back off slowly when they don't
+static int dev_interval(struct device_t * dev, int changed) {
+	if (dev->min_interval > 0) {
+		if (changed)
+			dev->cur_interval /= 2;
+		else
+			dev->cur_interval += dev->cur_interval / 4;
+		if (dev->cur_interval < dev->min_interval)
+			dev->cur_interval = dev->min_interval;
+		else if (dev->cur_interval > dev->interval)
+			dev->cur_interval = dev->interval;
 	}
+	return dev->cur_interval;
 }
 
-void fork_reader(struct port_t * port) {
-		pid_t pid = fork();
-		if (pid < 0) {
-			mylog("fork failed: %s", strerror(errno));
-			kill(0, SIGTERM); // kill whole process group
-			exit(EXIT_FAILURE);
-		} else if (pid == 0) { // child process
-			d0loop(port->path);
-			exit(EXIT_FAILURE);
-		}
-		port->pid = pid;
+// next deadline after due, the readout time doesn't add up and missed deadlines are skipped
+static long long next_due(long long due, int interval, long long now) {
+	due += interval;
+	if (due <= now)
+		due += ((now - due) / interval + 1) * interval;
+	return due;
 }
 
-void wait4sigchld() {
-	int status;
-	pid_t pid = wait(&status);
-	if (pid < 0) {
-		mylog("waitpid error: %s", strerror(errno));
+// earliest due device on a bus
+static long long bus_due(struct port_t * po) {
+	long long due = po->devs[0]->due;
+	for (int i=1; i<po->ndevs; ++i)
+		if (po->devs[i]->due < due)
+			due = po->devs[i]->due;
+	return due;
+}
+
+// next device to read on a bus: of the due devices the one with the highest priority,
+// with equal priority the one waiting longest (round robin for equal intervals)
+static struct device_t * bus_next(struct port_t * po, long long now) {
+	struct device_t * next = NULL;
+	for (int i=0; i<po->ndevs; ++i) {
+		struct device_t * dev = po->devs[i];
+		if (dev->due > now)
+			continue;
+		if (!next || dev->priority > next->priority || (dev->priority == next->priority && dev->due < next->due))
+			next = dev;
+	}
+	return next;
+}
+
+// schedule the next readout against the start of this one
+static void port_schedule(struct port_t * po, int changed, long long now) {
+	if (po->ndevs) {
+		struct device_t * dev = po->cur;
+		if (strcmp(dev->serial, po->d0->serial))
+			mylog("port %s address %s: got serial %s instead of %s", po->path, dev->address, po->d0->serial, dev->serial);
+		dev->due = next_due(dev->due, dev_interval(dev, changed), now);
+		po->due = bus_due(po);
 		return;
 	}
-	for (struct port_t * port=conf.port; port; port=port->next) { // search port of pid
-		if (port->pid == pid) {
-			mylog("child pid %d (port %s) exited with status %d", pid, port->path, status);
-			fork_reader(port);
+	struct device_t * dev = port_device(po);
+	po->due = next_due(po->due, dev ? dev_interval(dev, changed) : DEFAULT_INTERVAL, now);
+}
+
+// advance the port state machine, called when the port is due or its fd is readable
+static void port_step(int epfd, struct port_t * po, long long now) {
+	switch (po->state) {
+	case PORT_CLOSED:
+		po->d0 = d0_open(po->path);
+		if (!po->d0) {
+			mylog("d0_open %s failed (%s), retry in 10 seconds", po->path, strerror(errno));
+			po->due = now + 10000;
+			return;
+		}
+		mylog("opened port device %s", po->path);
+		if (po->sml)
+			d0_set_protocol(po->d0, D0_SML);
+		else if (po->push)
+			d0_set_protocol(po->d0, D0_PUSH);
+		if (po->maxbaud > 0) // the line speed for push
+			d0_set_maxbaud(po->d0, po->maxbaud);
+		d0_set_timeout(po->d0, po->timeout);
+		// the snapshot gets all registers, except the ones not read on select ports
+		if (!snap || po->select)
+			d0_set_filter(po->d0, chan_filter, NULL);
+		if (po->select)
+			d0_set_selective(po->d0, 1);
+		struct epoll_event ev = { .events = 0, .data.ptr = po };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, d0_get_fd(po->d0), &ev) < 0) {
+			mylog("epoll_ctl %s: %s", po->path, strerror(errno));
+			port_close(po, now);
 			return;
 		}
+		po->armed = 0;
+		po->errors = 0;
+		po->state = PORT_IDLE;
+		// push meters send on their own, listen right away instead of letting the telegrams pile up
+		po->due = po->push ? now : now + DEFAULT_INTERVAL;
+		break;
+	case PORT_IDLE: {
+		if (po->ndevs) {
+			if (!(po->cur = bus_next(po, now))) {
+				po->due = bus_due(po);
+				return;
+			}
+			d0_set_address(po->d0, po->cur->address);
+		}
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		po->tsms = (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		if (!d0_start_read(po->d0)) {
+			mylog("d0_read: %s", po->d0->errstr);
+			port_close(po, now);
+			return;
+		}
+		po->state = PORT_READ;
+		port_arm(epfd, po);
+		break;
+	}
+	case PORT_READ: {
+		enum d0_state state = d0_process(po->d0);
+		if (state == D0_ERROR) {
+			if (po->ndevs)
+				mylog("d0_read address %s: %s", po->cur->address, po->d0->errstr);
+			else
+				mylog("d0_read: %s", po->d0->errstr);
+			// keep the port (and the fallback state of libd0) after single errors
+			if (++po->errors >= PORT_MAX_ERRORS * (po->ndevs ? po->ndevs : 1)) {
+				port_close(po, now);
+			} else if (po->ndevs) { // try the other meters on the bus first
+				po->state = PORT_IDLE;
+				po->cur->due = now + po->cur->cur_interval;
+				po->due = bus_due(po);
+			} else {
+				po->state = PORT_IDLE;
+				if (po->push) // the meter sends on its own, listen again right away
+					po->due = now;
+				else // at the rate of the meter of the last readout
+					po->due = now + (po->dev ? po->dev->cur_interval : DEFAULT_INTERVAL);
+			}
+		} else if (state == D0_DONE) {
+			if (po->push || po->sml) // the time the telegram arrived, not when we started to wait for it
+				po->tsms = po->d0->tsms;
+			int changed = d0values(po->d0, po->tsms);
+			if (snap && !d0snap_publish(snap, po->d0, po->path, po->tsms))
+				DPRINT("snapshot full, serial %s not published", po->d0->serial);
+			po->errors = 0;
+			po->state = PORT_IDLE;
+			if (po->push) // listen for the next telegram right away
+				po->due = now;
+			else
+				port_schedule(po, changed, now); // due is still the start of the readout
+		} else {
+			port_arm(epfd, po);
+		}
+		break;
 	}
-	mylog("unknown pid %d exited with status %d", pid, status);
+	}
+}
+
+// next time the port needs attention (monotonic ms), -1 if it only waits for its fd
+static long long port_due(struct port_t * po, long long now) {
+	if (po->state != PORT_READ)
+		return po->due;
+	int t = d0_timeout(po->d0);
+	return t < 0 ? -1 : now + t;
 }
 
+// drive all ports from one event loop
+void d0loop(void) {
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		mylog("epoll_create: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	long long now = now_ms();
+	for (struct port_t * po=conf.port; po; po=po->next)
+		po->due = now; // open all ports right away
+
+	struct epoll_event evs[16];
+	while (1) {
+		long long next = -1;
+		now = now_ms();
+		for (struct port_t * po=conf.port; po; po=po->next) {
+			long long due = port_due(po, now);
+			if (due >= 0 && due <= now) {
+				port_step(epfd, po, now);
+				due = port_due(po, now);
+			}
+			if (due >= 0 && (next < 0 || due < next))
+				next = due;
+		}
+		int timeout = next < 0 ? -1 : next > now ? next - now : 0;
+		int n = epoll_wait(epfd, evs, DIM(evs), timeout);
+		if (n < 0 && errno != EINTR) {
+			mylog("epoll_wait: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		now = now_ms();
+		for (int i=0; i<n; ++i) {
+			struct port_t * po = evs[i].data.ptr;
+			po->armed = 0;
+			if (po->state == PORT_READ)
+				port_step(epfd, po, now);
+		}
+	}
+}
 
 /*** main ***/
 int main(int argc, char * argv[]) {
@@ -280,6 +676,10 @@ int main(int argc, char * argv[]) {
 		mylog("no ports to listen to, exiting...");
 		exit(EXIT_FAILURE);
 	}
+	chan_build();
+	bus_build();
+	if (conf.snapshot && !(snap = d0snap_open(conf.snapshot, 1)))
+		mylog("snapshot %s: %s", conf.snapshot, strerror(errno));
 
 	{ // install signal handlers
 		struct sigaction action;
@@ -291,13 +691,6 @@ int main(int argc, char * argv[]) {
 		sigaction(SIGHUP, &action, NULL);
 	}
 
-	for (struct port_t * port=conf.port; port; port=port->next) {
-		fork_reader(port);
-	}
-
-	/* wait for a child process to end */
-	while (1) {
-		wait4sigchld();
-	}
+	d0loop();
 }
 
@@ -5,6 +5,11 @@
 
 #define VZ_SPOOLFMT "%s%llu_%s_%s"
 
+// poll interval in ms if not set for the device
+#define DEFAULT_INTERVAL 2000
+// reopen a port after this many failed readouts in a row
+#define PORT_MAX_ERRORS 3
+
 //#define DEBUG
 #ifdef DEBUG
 #define DPRINT(format, args...) printf("%s: "format"\n", __FUNCTION__, ##args)
@@ -14,19 +19,56 @@
 
 struct port_t {
 	char *path;
-	pid_t pid; // stores the pid of the child process
+	int maxbaud; // baud rate limit for mode C, 0 for the libd0 default
+	int sml; // meter pushes SML telegrams
+	int push; // meter pushes IEC 62056-21 mode D telegrams, each one is read
+	int select; // read only the configured registers in programming mode
+	int timeout; // receive timeout in ms, 0 for the libd0 default
+	// runtime state, not set by config
+	D0 * d0; // NULL while the port is closed
+	enum { PORT_CLOSED, PORT_IDLE, PORT_READ } state;
+	long long due; // next open or readout (monotonic ms)
+	unsigned long long tsms; // start of the current readout
+	int armed; // fd is registered for EPOLLIN
+	int errors; // failed readouts in a row
+	struct device_t * dev; // device of the last readout
+	// multi-drop bus: devices configured with this port, polled by address
+	struct device_t ** devs;
+	int ndevs;
+	struct device_t * cur; // device of the current readout
 	struct port_t * next;
 };
 
+// fixed point number v * 10^-scale
+struct fixed {
+	int64_t v;
+	int scale;
+};
+
 struct channel_t {
 	char * oid; // 1-0:1.8.0*255
+	uint64_t obis; // packed oid
 	char * uuid; // aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee
-	char value[32]; // last value read (set during runtime, not by config)
+	struct fixed deadband; // post only changes larger than this
+	int relative; // deadband is in percent of the last posted value
+	int min_post, max_post; // post at most / at least every ms (0: not limited)
+	// set during runtime, not by config
+	char value[32]; // last value posted
+	struct fixed last; // value as number, if numeric
+	int numeric;
+	unsigned long long post_ts; // time of the last post
 	struct channel_t * next;
 };
 struct device_t {
 	char * oid; // e.g. 0-0:C.1.0*255
 	char * serial; // 12345 from 0-0:C.1.0*255(12345)
+	int interval; // poll interval in ms
+	int min_interval; // adaptive polling down to this interval (0: fixed interval)
+	int cur_interval; // current adaptive interval (runtime)
+	char * port; // port path for devices on a multi-drop bus (NULL: found by serial on any port)
+	char * address; // bus address for the sign on, default is the serial
+	int priority; // higher priority devices are read first when several are due
+	long long due; // next readout on the bus (runtime, monotonic ms)
 	// channel 1-0:1.8.0*255 aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee
 	struct channel_t * channel;
 	struct device_t * next;
@@ -35,9 +77,11 @@ struct device_t {
 struct config_t {
 	char * log;
 	char * spool;
-	// port /dev/serial/by-id/usb-FTDI_FT232R_USB_UART_xxxxxxxx-if00-port0
+	// snapshot [<path>], shared memory file with the latest readouts for d0query
+	char * snapshot;
+	// port /dev/serial/by-id/usb-FTDI_FT232R_USB_UART_xxxxxxxx-if00-port0 [9600] [sml|push] [select] [timeout <s>]
 	struct port_t * port;
-	// device 0-0:C.1.0*255 12345
+	// device 0-0:C.1.0*255 12345 [<interval>] [adaptive <min interval>] [port <path> [address <addr>] [priority <n>]]
 	struct device_t * device;
 };
 
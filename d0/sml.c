@@ -0,0 +1,337 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "d0priv.h"
+#include "sml.h"
+
+// SML (smart message language) push protocol of EDL21/eHZ meters.
+// a transport frame looks like this (escape sequences are aligned to 4 bytes):
+//   1b1b1b1b 01010101 <messages> [padding] 1b1b1b1b 1a <padding count> <crc16>
+// a literal 1b1b1b1b in the messages is escaped as 1b1b1b1b 1b1b1b1b.
+// the messages are TLV encoded, we only look at GetList.Res messages (the list of
+// values the meter pushes) and ignore all others.
+
+#define SML_ESC 0x1b
+#define SML_START 0x01
+#define SML_END 0x1a
+
+// message body tag of GetList.Res
+#define SML_GETLIST_RES 0x0701
+
+// TLV types
+#define SML_OCTETS 0
+#define SML_BOOL 4
+#define SML_INT 5
+#define SML_UINT 6
+#define SML_LIST 7
+
+/* crc16 (x.25, reflected polynomial 0x8408) ************************/
+
+static uint16_t crctab[256];
+
+static void crc_init() {
+	for (int i=0; i<256; ++i) {
+		uint16_t crc = i;
+		for (int j=0; j<8; ++j)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+		crctab[i] = crc;
+	}
+}
+
+static uint16_t crc16(const unsigned char * buf, size_t len) {
+	uint16_t crc = 0xffff;
+	if (crctab[1] == 0)
+		crc_init();
+	while (len--)
+		crc = (crc >> 8) ^ crctab[(crc ^ *buf++) & 0xff];
+	return crc ^ 0xffff;
+}
+
+/* TLV decoding *****************************************************/
+
+struct tlv {
+	int type;
+	size_t len; // value length in bytes, or number of elements of a list
+	const unsigned char * val;
+};
+
+// read type-length field at *p and advance *p to the next element. returns 0 on errors
+static int tlv_next(const unsigned char ** p, const unsigned char * end, struct tlv * t) {
+	const unsigned char * q = *p;
+	if (q >= end)
+		return 0;
+	t->type = (*q >> 4) & 7;
+	t->len = *q & 0x0f;
+	while (*q++ & 0x80) { // more length bytes
+		if (q >= end)
+			return 0;
+		t->len = (t->len << 4) | (*q & 0x0f);
+	}
+	t->val = q;
+	if (t->type != SML_LIST) { // length includes the type-length bytes
+		size_t tl = q - *p;
+		if (t->len < tl || *p + t->len > end)
+			return 0;
+		t->len -= tl;
+		q = *p + tl + t->len;
+	}
+	*p = q;
+	return 1;
+}
+
+// skip an element, including all elements of a list
+static int tlv_skip(const unsigned char ** p, const unsigned char * end) {
+	struct tlv t;
+	if (!tlv_next(p, end, &t))
+		return 0;
+	if (t.type == SML_LIST)
+		for (size_t i=0; i<t.len; ++i)
+			if (!tlv_skip(p, end))
+				return 0;
+	return 1;
+}
+
+// integer value of an int or uint element
+static int tlv_int(const struct tlv * t, int64_t * v) {
+	if ((t->type != SML_INT && t->type != SML_UINT) || t->len == 0 || t->len > 8)
+		return 0;
+	uint64_t u = (t->type == SML_INT && (t->val[0] & 0x80)) ? ~0ull : 0; // sign extension
+	for (size_t i=0; i<t->len; ++i)
+		u = (u << 8) | t->val[i];
+	if (t->type == SML_UINT && t->len == 8 && (u >> 63))
+		return 0; // doesn't fit
+	*v = u;
+	return 1;
+}
+
+/* value conversion *************************************************/
+
+// DLMS unit codes
+static const char * unit_name(int unit) {
+	switch (unit) {
+	case 9: return "°C";
+	case 27: return "W";
+	case 28: return "VA";
+	case 29: return "var";
+	case 30: return "Wh";
+	case 31: return "VAh";
+	case 32: return "varh";
+	case 33: return "A";
+	case 35: return "V";
+	case 44: return "Hz";
+	default: return "";
+	}
+}
+
+// format v * 10^scaler without floating point
+static int format_value(char * buf, size_t size, int64_t v, int scaler) {
+	const char * sign = "";
+	uint64_t u = v;
+	if (v < 0) {
+		sign = "-";
+		u = -(uint64_t)v;
+	}
+	if (scaler >= 0) {
+		int n = snprintf(buf, size, "%s%llu", sign, (unsigned long long)u);
+		for (; scaler > 0 && n > 0 && n < size-1; --scaler)
+			buf[n++] = '0';
+		if (n <= 0 || n >= size || scaler > 0)
+			return 0;
+		buf[n] = 0;
+		return 1;
+	}
+	uint64_t p10 = 1;
+	for (int i=scaler; i<0; ++i)
+		p10 *= 10;
+	int n = snprintf(buf, size, "%s%llu.%0*llu", sign, (unsigned long long)(u / p10), -scaler, (unsigned long long)(u % p10));
+	return n > 0 && n < size;
+}
+
+// copy str into the register storage
+static char * store(D0 * d0, const char * str) {
+	size_t len = strlen(str);
+	char * p = d0_alloc(d0, len+1);
+	if (p)
+		memcpy(p, str, len+1);
+	return p;
+}
+
+// store one value list entry: list(7) of objName, status, valTime, unit, scaler, value, valueSignature
+static int list_entry(D0 * d0, const unsigned char ** p, const unsigned char * end) {
+	struct tlv t, obj, unit, scaler, value;
+	if (!tlv_next(p, end, &t) || t.type != SML_LIST || t.len != 7 ||
+	    !tlv_next(p, end, &obj) || !tlv_skip(p, end) || !tlv_skip(p, end) ||
+	    !tlv_next(p, end, &unit) || !tlv_next(p, end, &scaler) ||
+	    !tlv_next(p, end, &value) || !tlv_skip(p, end))
+		return 0;
+	if (obj.type != SML_OCTETS || obj.len != 6)
+		return 1; // not an obis value
+	const unsigned char * o = obj.val;
+	uint64_t obis = D0_OBIS(o[0], o[1], o[2], o[3], o[4], o[5]);
+	if (d0->_filter && !d0->_filter(d0, obis, d0->_filter_arg))
+		return 1;
+	struct d0val * val = d0_val_new(d0);
+	char id[32], buf[32];
+	if (!val || !(val->id = store(d0, d0_obis_format(obis, id, sizeof(id)))))
+		return 1; // out of memory
+	val->obis = obis;
+	int64_t v, u = 0, s = 0;
+	tlv_int(&unit, &u);
+	tlv_int(&scaler, &s);
+	if (tlv_int(&value, &v)) {
+		if (!format_value(buf, sizeof(buf), v, s) || !(val->val = store(d0, buf)) ||
+		    !(val->unit = store(d0, unit_name(u))))
+			return 1;
+	} else if (value.type == SML_OCTETS) { // e.g. device id, as hex string
+		if (!(val->val = d0_alloc(d0, 2*value.len+1)) || !(val->unit = store(d0, "")))
+			return 1;
+		val->val[0] = 0;
+		for (size_t i=0; i<value.len; ++i)
+			sprintf(val->val+2*i, "%02x", value.val[i]);
+	} else {
+		return 1; // bool, list, ... not supported
+	}
+	++d0->vals;
+	return 1;
+}
+
+// GetList.Res: list(7) of clientId, serverId, listName, actSensorTime, valList, listSignature, actGatewayTime
+static int getlist_res(D0 * d0, const unsigned char ** p, const unsigned char * end) {
+	struct tlv t, server;
+	if (!tlv_next(p, end, &t) || t.type != SML_LIST || t.len != 7 ||
+	    !tlv_skip(p, end) || !tlv_next(p, end, &server) || !tlv_skip(p, end) || !tlv_skip(p, end))
+		return 0;
+	if (server.type == SML_OCTETS && server.len > 0) {
+		// server id, usually 10 bytes (DIN 43863-5): type, number, manufacturer (3), fabrication block, serial (4)
+		strcpy(d0->id, "SML ");
+		for (size_t i=0; i<server.len && 4+2*i+2<sizeof(d0->id); ++i)
+			sprintf(d0->id+4+2*i, "%02x", server.val[i]);
+		if (server.len == 10) {
+			const unsigned char * sn = server.val + 6;
+			snprintf(d0->serial, sizeof(d0->serial), "%u", (unsigned)sn[0] << 24 | sn[1] << 16 | sn[2] << 8 | sn[3]);
+		} else {
+			snprintf(d0->serial, sizeof(d0->serial), "%s", d0->id+4);
+		}
+	}
+	if (!tlv_next(p, end, &t) || t.type != SML_LIST)
+		return 0;
+	for (size_t i=0; i<t.len; ++i)
+		if (!list_entry(d0, p, end))
+			return 0;
+	return tlv_skip(p, end) && tlv_skip(p, end);
+}
+
+// decode all messages of a frame: list(6) of transactionId, groupNo, abortOnError, messageBody, crc16, endOfSmlMsg
+static int messages(D0 * d0, const unsigned char * p, const unsigned char * end) {
+	while (p < end) {
+		struct tlv t, tag;
+		if (*p == 0x00) { // end of message or padding
+			++p;
+			continue;
+		}
+		if (!tlv_next(&p, end, &t) || t.type != SML_LIST || t.len != 6 ||
+		    !tlv_skip(&p, end) || !tlv_skip(&p, end) || !tlv_skip(&p, end) ||
+		    !tlv_next(&p, end, &t) || t.type != SML_LIST || t.len != 2 || !tlv_next(&p, end, &tag))
+			return 0;
+		int64_t body;
+		if (tlv_int(&tag, &body) && body == SML_GETLIST_RES) {
+			if (!getlist_res(d0, &p, end))
+				return 0;
+		} else if (!tlv_skip(&p, end)) {
+			return 0;
+		}
+		if (!tlv_skip(&p, end)) // crc of message, the frame crc is enough
+			return 0;
+	}
+	return 1;
+}
+
+/* transport layer **************************************************/
+
+static const unsigned char sml_start[8] = { SML_ESC, SML_ESC, SML_ESC, SML_ESC, SML_START, SML_START, SML_START, SML_START };
+
+void sml_reset(struct sml * sml) {
+	sml->sync = 0;
+	sml->esc = 0;
+	sml->len = 0;
+}
+
+// frame is complete: check crc, unescape and decode it
+static enum d0_state frame_end(D0 * d0, struct sml * sml) {
+	unsigned char * f = sml->frame;
+	size_t len = sml->len;
+	uint16_t crc = crc16(f, len-2);
+	if ((f[len-2] | f[len-1] << 8) != crc) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "SML checksum mismatch: calculated %04hx but got %02hhx%02hhx", crc, f[len-1], f[len-2]);
+		return D0_ERROR;
+	}
+	// unescape messages in place: from behind the start to before the end sequence
+	size_t out = 8;
+	for (size_t in=8; in<len-8; in+=4) {
+		if (!memcmp(f+in, sml_start, 4))
+			in += 4; // escaped escape sequence, copy the second one
+		memmove(f+out, f+in, 4);
+		out += 4;
+	}
+	size_t pad = f[len-3];
+	if (pad > 3 || out < 8 + pad) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "SML invalid padding %zu", pad);
+		return D0_ERROR;
+	}
+	if (!messages(d0, f+8, f+out-pad)) {
+		snprintf(d0->errstr, sizeof(d0->errstr), "SML message decoding failed");
+		return D0_ERROR;
+	}
+	return D0_DONE;
+}
+
+enum d0_state sml_parse(D0 * d0, const unsigned char * buf, size_t len) {
+	struct sml * sml = d0->_sml;
+	for (const unsigned char * end = buf+len; buf < end && d0->_p.state < D0_DONE; ++buf) {
+		unsigned char c = *buf;
+		if (sml->sync < 8) { // search start sequence
+			if (sml->sync < 4)
+				sml->sync = (c == SML_ESC) ? sml->sync + 1 : 0;
+			else if (c == SML_START)
+				++sml->sync;
+			else if (sml->sync > 4 || c != SML_ESC) // more than 4 esc are fine
+				sml->sync = (c == SML_ESC);
+			if (sml->sync == 8) {
+				d0_stamp(d0, end - buf - 1 + 7); // at the first escape byte
+				memcpy(sml->frame, sml_start, 8);
+				sml->len = 8;
+				sml->esc = 0;
+				d0->_p.state = D0_DATA;
+			}
+			continue;
+		}
+		if (sml->len >= sizeof(sml->frame)) {
+			snprintf(d0->errstr, sizeof(d0->errstr), "SML frame too long");
+			d0->_p.state = D0_ERROR;
+			break;
+		}
+		sml->frame[sml->len++] = c;
+		if (sml->len % 4)
+			continue;
+		const unsigned char * g = sml->frame + sml->len - 4; // complete 4 byte group
+		if (sml->esc) { // group after escape
+			sml->esc = 0;
+			if (g[0] == SML_END) {
+				d0->_p.state = frame_end(d0, sml);
+				sml->sync = 0;
+			} else if (!memcmp(g, sml_start+4, 4)) { // new start, the frame before was incomplete
+				d0_stamp(d0, end - buf - 1 + 7);
+				memcpy(sml->frame, sml_start, 8);
+				sml->len = 8;
+				d0->vals = 0;
+			} else if (memcmp(g, sml_start, 4)) {
+				snprintf(d0->errstr, sizeof(d0->errstr), "SML invalid escape sequence %02hhx%02hhx%02hhx%02hhx", g[0], g[1], g[2], g[3]);
+				d0->_p.state = D0_ERROR;
+			}
+		} else if (!memcmp(g, sml_start, 4)) {
+			sml->esc = 1;
+		}
+	}
+	return d0->_p.state;
+}
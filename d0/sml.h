@@ -0,0 +1,21 @@
+#ifndef SML_H
+#define SML_H
+
+#include "d0.h"
+
+// max size of an SML transport frame (escaped, with start and end sequence)
+#define SML_FRAMESIZE 2048
+
+// streaming transport layer state
+struct sml {
+	int sync; // matched bytes of the start sequence
+	int esc; // last 4 byte group was an escape sequence
+	size_t len; // bytes in frame
+	unsigned char frame[SML_FRAMESIZE];
+};
+
+void sml_reset(struct sml * sml);
+// feed received bytes, decoded values of a complete frame are stored in d0
+enum d0_state sml_parse(D0 * d0, const unsigned char * buf, size_t len);
+
+#endif
@@ -12,11 +12,14 @@
 #include <linux/input.h>
 #include <signal.h>
 #include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "ev2vzs_ts.h"
 
 #define PROG "ev2vzs"
-#define VER "0.5.7"
+#define VER "0.6.0"
 // /path/to/spool/timestamp_uuid_value
 #define VZ_SPOOLFMT "%s%llu_%s_%g"
 
@@ -31,6 +34,8 @@
 #define DUMP(pre, buf, len) do { /* nothing */ } while (0)
 #endif
 
+#define DIM(vec) (sizeof(vec)/sizeof(vec[0]))
+
 typedef unsigned long long TSMS;
 #define CALC_TSMS(tv) ((TSMS) tv.tv_sec * 1000 + tv.tv_usec / 1000)
 
@@ -38,7 +43,7 @@ typedef unsigned long long TSMS;
 // number of qwords (64bit) necessray to store the given number of bits
 #define bits64(n)     (((n) + 64 - 1)>>6)
 // check if bit n is set in (u)int64 array p
-#define bit_get(p, n) (!!(p[(n)>>6] & (1u << ((n)&63))))
+#define bit_get(p, n) (!!(p[(n)>>6] & (1ull << ((n)&63))))
 
 // config /////////////////////////
 
@@ -47,16 +52,40 @@ struct tariff {
 	const char * uuid; // VZ UUID
 	TSMS ts;  // timestamp of latest event
 	int cnt; // accumulated counts, if interval is set (i.e., > 0), is reset to 0 after post
+	TSMS first_ts; // timestamp of the first queued impulse
+	TSMS post_ts; // time of the latest post
+	TSMS due; // time when the queued impulses have to be posted, 0 if nothing is queued
+};
+
+// flush policy: post queued impulses when <count> impulses are queued or the first queued impulse
+// is <tmax> old, but never within <tmin> after the previous post
+struct policy {
+	int count; // 0: no count limit
+	TSMS tmin, tmax; // ms, tmax == 0: no policy set
 };
 
 struct button {
-	uint16_t code;
 	const char * name;
+	uint16_t code;
+};
+// short names for mouse buttons (kept for compatibility with old configs)
+static const struct button buttons[] = {
+	{ "L", BTN_LEFT }, { "R", BTN_RIGHT }, { "M", BTN_MIDDLE }, { "S", BTN_SIDE }, { "E", BTN_EXTRA },
+	{ NULL, 0 }
+};
+// all KEY_* and BTN_* names from linux/input-event-codes.h, sorted by name (generated by make)
+static const struct button keynames[] = {
+#include "ev2vzs_keys.h"
 };
-struct button buttons[] = {
-	{ BTN_LEFT, "L" }, { BTN_RIGHT, "R" }, { BTN_MIDDLE, "M" }, { BTN_SIDE, "S" }, { BTN_EXTRA, "E" }, 
-	{ 0, NULL }
+
+// power derived from the impulse intervals, posted as interval average (and min/max) to its own channels
+struct power {
+	const char * uuid[3]; // UUIDs for average, minimum and maximum power (NULL if not posted)
+	TSMS dt; // sum of impulse intervals in the current spool interval
+	int n; // number of impulse intervals in dt
+	double min, max; // extreme values in the current spool interval
 };
+enum { PWR_AVG, PWR_MIN, PWR_MAX };
 
 struct channel {
 	union {
@@ -65,9 +94,14 @@ struct channel {
 			struct tariff peak, offpeak;
 		};
 	};
-	struct button *btn_imp, *btn_trf; // buttons codes for impulse and tariff (from struct input_event)
+	struct button btn_imp, btn_trf; // buttons codes for impulse and tariff (from struct input_event), code 0 if unused
 	double val; // value per impulse
+	TSMS ts; // timestamp of latest impulse (regardless of tariff)
+	struct power pwr;
+	struct policy pol; // flush policy (if pol.tmax is 0, the global policy or interval is used)
+	TSMS release_ts; // timestamp of latest release of the impulse button (for debouncing)
 	unsigned int act : 1; // active tariff, 0 = peak, 1 = offpeak
+	unsigned int pressed : 1; // state of the impulse button
 	struct channel * next;
 };
 
@@ -79,14 +113,67 @@ struct config_t {
 	char * spool;
 	char * dev;
 	int interval;
-	struct timespec read_wait;
+	struct policy pol; // default flush policy for all channels, overrides interval
+	int debounce; // ms
+	char * live; // path of the live stream unix socket
 	struct channel * chan;
 };
 
+// capture file format: header followed by fixed size records in host byte order
+#define CAP_MAGIC "EV2VZCAP"
+#define CAP_VERSION 1
+struct cap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recsize; // sizeof(struct cap_record)
+};
+struct cap_record {
+	uint64_t usec; // event time in microseconds since the epoch
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+// live stream clients. messages that don't fit into the buffer of a slow client are dropped
+#define LIVE_CLIENTS 8
+#define LIVE_BUFSIZE 4096
+struct live_client {
+	int fd; // -1 if unused
+	size_t len; // bytes in buf
+	unsigned long dropped; // messages dropped since the last one that fit
+	char buf[LIVE_BUFSIZE];
+};
+
+// command line options
+struct options_t {
+	const char * capture; // write all events read from the device to this file
+	const char * replay; // read events from this file instead of the device
+	long long synth; // number of synthetic impulses per channel to generate instead of reading the device
+	int synth_period; // ms between synthetic impulses
+	double speed; // replay speed factor, 0 = as fast as possible
+	const char * spool; // spool path for replayed and synthetic impulses, dry run if not set
+	int quiet; // don't log single impulses
+};
+
 // globals ///////////////////////
 
 static struct config_t conf;
 int dev_fd = -1;
+int timer_fd = -1; // fires at the end of the spool interval if there are queued impulses
+TSMS flush_ts = 0; // earliest due time of all queued impulses (the timer is set to it), 0 if nothing is queued
+static struct options_t opt;
+static FILE * cap_fh = NULL; // capture file
+static int replaying = 0; // events don't come from the device, the event time is the clock
+static int dry_run = 0; // print the spool entries to stdout instead of creating the files
+static unsigned long long spool_cnt = 0; // number of spool entries
+static unsigned long long ev_cnt = 0, imp_cnt = 0; // number of handled events and impulses
+static unsigned long long drop_cnt = 0; // number of kernel buffer overruns (SYN_DROPPED)
+static int live_fd = -1; // listening live stream socket
+static struct live_client live[LIVE_CLIENTS];
+static struct input_event * evbuf = NULL; // read buffer, grows if reads fill it up
+static size_t evbuf_size = 0; // number of events in evbuf
+#define EVBUF_MIN 64
+#define EVBUF_MAX 4096
 
 /*** logging and signal handling *************************************************/
 
@@ -154,14 +241,33 @@ static void * myalloc(size_t size) {
 	exit(EXIT_FAILURE);
 }
 
-static int find_button(char * name, struct button ** btn) {
-	for (struct button * b=buttons; b->code>0; ++b)
+static int cmp_button(const void * a, const void * b) {
+	return strcmp(((const struct button *)a)->name, ((const struct button *)b)->name);
+}
+
+// find key code for name. accepts the short mouse button names, any KEY_xxx or BTN_xxx name
+// and numeric codes (decimal or 0x hex). returns the code, or 0 if name is unknown
+static int find_button(char * name, struct button * btn) {
+	const struct button * b;
+	int code = 0;
+	for (b=buttons; b->name; ++b)
 		if (strcmp(name, b->name) == 0) {
-			if (btn != NULL)
-				*btn = b;
-			return b->code;
+			code = b->code;
+			break;
 		}
-	return 0;
+	if (!code && (b = bsearch(&(struct button){ name, 0 }, keynames, DIM(keynames), sizeof(keynames[0]), cmp_button)))
+		code = b->code;
+	if (!code) {
+		char * endptr;
+		long l = strtol(name, &endptr, 0);
+		if (*endptr == '\0' && l > 0 && l < KEY_CNT)
+			code = l;
+	}
+	if (code && btn != NULL) {
+		btn->code = code;
+		btn->name = strdup(name);
+	}
+	return code;
 }
 
 #define CONFIG_ELEM(c,dest) ((c=strtok(NULL,CONF_SEP)) && (dest=strdup(c)))
@@ -205,18 +311,49 @@ static struct config_t * read_config(char * conffile, struct config_t * conf) {
 					mylog("config error in line %d (interval)", lines);
 			} else
 				mylog("config error in line %d (interval)", lines);
-		} else if (!strcmp(c, "read_wait")) {
+		} else if (!strcmp(c, "flush") || !strcmp(c, "flush_channel")) {
+			struct policy * pol = &conf->pol;
+			char *p, *cnt, *tmin, *tmax, *endptr;
+			double dmin, dmax; // s, checked before they go into the unsigned ms
+			int code;
+			struct channel * ch = NULL;
+			if (!strcmp(c, "flush_channel")) {
+				if (CONFIG_ELEM_PTR(c, p) && (code = find_button(p, NULL)) && (ch = b2c[code]) && ch->btn_imp.code == code) {
+					pol = &ch->pol;
+				} else {
+					mylog("config error in line %d (flush_channel), is the impulse button defined before?", lines);
+					continue;
+				}
+			}
+			if (CONFIG_ELEM_PTR(c, cnt) && CONFIG_ELEM_PTR(c, tmin) && CONFIG_ELEM_PTR(c, tmax) &&
+			    (pol->count = strtol(cnt, &endptr, 10)) >= 0 && *endptr == '\0' &&
+			    (dmin = strtod(tmin, &endptr)) >= 0 && *endptr == '\0' &&
+			    (dmax = strtod(tmax, &endptr)) > 0 && *endptr == '\0' && dmax >= dmin)
+			{
+				pol->tmin = dmin * 1000;
+				pol->tmax = dmax * 1000;
+				DPRINT("line %d: flush policy for %s: count %d tmin %llu ms tmax %llu ms", lines, ch ? ch->peak.name : "all channels", pol->count, pol->tmin, pol->tmax);
+			} else {
+				memset(pol, 0, sizeof(*pol));
+				mylog("config error in line %d (%s)", lines, ch ? "flush_channel" : "flush");
+			}
+		} else if (!strcmp(c, "debounce")) {
 			char *p, *endptr;
 			if (CONFIG_ELEM(c, p) && *p != '\0') {
-				long ms = strtol(p, &endptr, 10);
-				if (*endptr == '\0') {
-					DPRINT("line %d: read wait time %ld ms", lines, ms);
-					conf->read_wait.tv_nsec = ms * 1000 * 1000; // ms to ns
-				}
+				conf->debounce = strtol(p, &endptr, 10);
+				if (*endptr == '\0')
+					DPRINT("line %d: debounce time %d ms", lines, conf->debounce);
 				else
-					mylog("config error in line %d (read_wait)", lines);
+					mylog("config error in line %d (debounce)", lines);
 			} else
-				mylog("config error in line %d (read_wait)", lines);
+				mylog("config error in line %d (debounce)", lines);
+		} else if (!strcmp(c, "read_wait")) {
+			mylog("config line %d: read_wait is obsolete and ignored, events are read immediately now", lines);
+		} else if (!strcmp(c, "live")) {
+			if (CONFIG_ELEM(c, conf->live))
+				DPRINT("line %d: live stream socket '%s'", lines, conf->live);
+			else
+				mylog("config error in line %d (live)", lines);
 		} else if (!strcmp(c, "device")) {
 			if (CONFIG_ELEM(c, conf->dev))
 				DPRINT("line %d: device path '%s'", lines, conf->dev);
@@ -225,8 +362,8 @@ static struct config_t * read_config(char * conffile, struct config_t * conf) {
 		} else if (!strcmp(c, "button")) {
 			struct channel * ch = myalloc(sizeof(struct channel));
 			char *bnam, *val;
-			struct button *b;
-			if (CONFIG_ELEM_PTR(c, bnam) && find_button(bnam, &b) &&
+			struct button *b = &ch->btn_imp;
+			if (CONFIG_ELEM_PTR(c, bnam) && find_button(bnam, b) &&
 			    CONFIG_ELEM(c, ch->peak.name) && CONFIG_ELEM(c, ch->peak.uuid) &&
 			    CONFIG_ELEM_PTR(c, val) && (ch->val = atof(val)))
 			{
@@ -234,14 +371,14 @@ static struct config_t * read_config(char * conffile, struct config_t * conf) {
 				++chans;
 				*ch0 = ch; // save ch in current ch0 (which is conf.ch or the previous ch->next) ...
 				ch0 = &ch->next; // and let ch0 point to the next pointer (for the next channel)
-				ch->btn_imp = b;
 				if (b2c[b->code]) {
 					mylog("ERROR! channel %s impulse button %s is already used by channel %s", ch->peak.name, bnam, b2c[b->code]->peak.name);
 					return NULL;
 				}
 				b2c[b->code] = ch;
 				if (CONFIG_ELEM_PTR(c, bnam)) { // off-peak tariff given, get tariff switch button
-					if (find_button(bnam, &b) &&
+					b = &ch->btn_trf;
+					if (find_button(bnam, b) &&
 					    CONFIG_ELEM(c, ch->offpeak.name) && CONFIG_ELEM(c, ch->offpeak.uuid))
 					{
 						/*if (b->channel) {
@@ -254,13 +391,13 @@ static struct config_t * read_config(char * conffile, struct config_t * conf) {
 						}*/
 						DPRINT("line %d:   off-peak button %s (0x%03hx) name %s uuid %s", 
 							lines, bnam, b->code, ch->offpeak.name, ch->offpeak.uuid);
-						ch->btn_trf = b;
 						if (b2c[b->code]) {
 							mylog("ERROR! channel %s tariff button %s is already used by channel %s", ch->peak.name, bnam, b2c[b->code]->peak.name);
 							return NULL;
 						}
 						b2c[b->code] = ch;
 					} else {
+						b->code = 0;
 						mylog("config error in line %d (button off-peak)", lines);
 					}
 				}
@@ -268,6 +405,21 @@ static struct config_t * read_config(char * conffile, struct config_t * conf) {
 				mylog("config error in line %d (button)", lines);
 				free(ch); // possible mem leak, but doesn't matter
 			}
+		} else if (!strcmp(c, "power")) {
+			char *bnam;
+			struct channel * ch = NULL;
+			int code;
+			if (CONFIG_ELEM_PTR(c, bnam) && (code = find_button(bnam, NULL)) && (ch = b2c[code]) && ch->btn_imp.code == code &&
+			    CONFIG_ELEM(c, ch->pwr.uuid[PWR_AVG]))
+			{
+				for (int i=PWR_MIN; i<=PWR_MAX; ++i)
+					if (CONFIG_ELEM(c, ch->pwr.uuid[i]) && !strcmp(ch->pwr.uuid[i], "-"))
+						ch->pwr.uuid[i] = NULL;
+				DPRINT("line %d: power for channel %s uuid avg %s min %s max %s", lines, ch->peak.name,
+					ch->pwr.uuid[PWR_AVG], ch->pwr.uuid[PWR_MIN] ?: "-", ch->pwr.uuid[PWR_MAX] ?: "-");
+			} else {
+				mylog("config error in line %d (power), is the impulse button defined before?", lines);
+			}
 		} else {
 			mylog("config line %d invalid: '%.99s'", lines, line);
 		}
@@ -287,9 +439,9 @@ static void update_tariff_states() {
 	else
 		DPRINT("ioctl EVIOCGKEY: requested %ld, got %d", sizeof(keys), rc);
 	for (struct channel *ch=conf.chan; ch; ch=ch->next)
-		if (ch->btn_trf) {
-			ch->act = bit_get(keys, ch->btn_trf->code);
-			mylog("button %s has value %d, set active tariff to %s (other: %s)", ch->btn_trf->name, ch->act, ch->trf[ch->act].name, ch->trf[!ch->act].name);
+		if (ch->btn_trf.code) {
+			ch->act = bit_get(keys, ch->btn_trf.code);
+			mylog("button %s has value %d, set active tariff to %s (other: %s)", ch->btn_trf.name, ch->act, ch->trf[ch->act].name, ch->trf[!ch->act].name);
 		}
 }
 
@@ -303,7 +455,7 @@ static void reopen_device() {
 	
 	while (1) {
 		mylog("opening %s", dev_path);
-		dev_fd = open(dev_path, O_RDWR | (conf.interval > 0 ? O_NONBLOCK : 0) );
+		dev_fd = open(dev_path, O_RDWR | O_NONBLOCK);
 		if (dev_fd >= 0)
 			break;
 		mylog("could not open %s: %m", dev_path);
@@ -338,12 +490,50 @@ static void reopen_device() {
 	}
 	mylog("device: %s on %s", devname, phys);
 
+	{ // check if the device can report all the keys we use
+		uint64_t keys[bits64(KEY_CNT)];
+		memset(keys, 0, sizeof(keys));
+		if (ioctl(dev_fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0)
+			mylog("evdev ioctl EVIOCGBIT error: %m");
+		else
+			for (struct channel *ch=conf.chan; ch; ch=ch->next) {
+				if (!bit_get(keys, ch->btn_imp.code))
+					mylog("warning: device does not support impulse key %s (0x%03hx) of channel %s", ch->btn_imp.name, ch->btn_imp.code, ch->peak.name);
+				if (ch->btn_trf.code && !bit_get(keys, ch->btn_trf.code))
+					mylog("warning: device does not support tariff key %s (0x%03hx) of channel %s", ch->btn_trf.name, ch->btn_trf.code, ch->peak.name);
+			}
+	}
+
+	{ // size the read buffer, so the whole kernel buffer can be read at once
+		size_t size = EVBUF_MIN;
+#ifdef EVIOCGBUFSIZE
+		int kbuf;
+		if (ioctl(dev_fd, EVIOCGBUFSIZE, &kbuf) == 0 && kbuf > size)
+			size = kbuf < EVBUF_MAX ? kbuf : EVBUF_MAX;
+#endif
+		if (size > evbuf_size) {
+			evbuf = realloc(evbuf, size * sizeof(*evbuf));
+			if (!evbuf) {
+				mylog("malloc read buffer failed: %m");
+				exit(EXIT_FAILURE);
+			}
+			evbuf_size = size;
+		}
+		DPRINT("read buffer size is %zu events", evbuf_size);
+	}
+
 	update_tariff_states();
 }
 
 static void vzspool(TSMS tsms, const char * uuid, const double val) {
 	char spoolfile[256];
 	snprintf(spoolfile, sizeof(spoolfile), VZ_SPOOLFMT, conf.spool, tsms, uuid, val);
+	++spool_cnt;
+	if (dry_run) {
+		if (!opt.quiet)
+			printf("%s\n", spoolfile);
+		return;
+	}
 	int fd = open(spoolfile, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
 	if (fd < 0) {
 		mylog("ERROR: open %s: %m", spoolfile);
@@ -353,40 +543,590 @@ static void vzspool(TSMS tsms, const char * uuid, const double val) {
 	}
 }
 
+// post the power statistics of the current interval
+static void power_post(struct channel * ch) {
+	struct power * pwr = &ch->pwr;
+	if (pwr->n == 0)
+		return;
+	// average over the interval is energy / time, not the mean of the impulse powers
+	double avg = (3600.0 * 1000) * ch->val * pwr->n / pwr->dt;
+	DPRINT("power channel %s n %d avg %g min %g max %g", ch->peak.name, pwr->n, avg, pwr->min, pwr->max);
+	vzspool(ch->ts, pwr->uuid[PWR_AVG], avg);
+	if (pwr->uuid[PWR_MIN])
+		vzspool(ch->ts, pwr->uuid[PWR_MIN], pwr->min);
+	if (pwr->uuid[PWR_MAX])
+		vzspool(ch->ts, pwr->uuid[PWR_MAX], pwr->max);
+	pwr->n = 0;
+	pwr->dt = 0;
+}
+
+static void post_tariff(struct channel * ch, struct tariff * trf, TSMS now) {
+	DPRINT("spooled channel %s UUID %s ts %lld cnt %d", trf->name, trf->uuid, trf->ts, trf->cnt);
+	vzspool(trf->ts, trf->uuid, ch->val * trf->cnt);
+	power_post(ch);
+	trf->cnt = 0;
+	trf->due = 0;
+	trf->post_ts = now;
+}
+
+// post all queued impulses
 static void dequeue() {
-	for (struct channel * ch = conf.chan; ch; ch=ch->next) {
-		struct tariff * trf  = &ch->peak;
-		if (trf->cnt > 0) {
-			DPRINT("spooled channel %s UUID %s ts %lld cnt %d", trf->name, trf->uuid, trf->ts, trf->cnt);
-			vzspool(trf->ts, trf->uuid, ch->val * trf->cnt);
-			trf->cnt = 0;
+	for (struct channel * ch = conf.chan; ch; ch=ch->next)
+		for (int i=0; i<2; ++i)
+			if (ch->trf[i].cnt > 0)
+				post_tariff(ch, &ch->trf[i], ch->trf[i].due);
+	flush_ts = 0;
+}
+
+// arm the timer for the earliest due time
+static void set_timer(TSMS due) {
+	flush_ts = due;
+	if (timer_fd < 0)
+		return; // replay, flush_due() is called with the event time
+	struct itimerspec its = { { 0, 0 }, { due / 1000, due % 1000 * 1000000 } }; // due == 0 disarms
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+		mylog("ERROR! timerfd_settime: %m");
+	DPRINT("next spool time: %llu", due);
+}
+
+// post queued impulses that are due at time now and set the timer to the next due time
+static void flush_due(TSMS now) {
+	if (!flush_ts || now < flush_ts)
+		return;
+	TSMS next = 0;
+	for (struct channel * ch = conf.chan; ch; ch=ch->next)
+		for (int i=0; i<2; ++i) {
+			struct tariff * trf = &ch->trf[i];
+			if (!trf->due)
+				continue;
+			if (trf->due <= now)
+				post_tariff(ch, trf, now);
+			else if (!next || trf->due < next)
+				next = trf->due;
+		}
+	set_timer(next);
+}
+
+// queue an impulse and calculate when the tariff's queue is due. without a flush policy, this is the
+// end of the current interval (aligned to full <interval> seconds).
+static void queue_impulse(struct channel * ch, struct tariff * trf, TSMS tsms) {
+	const struct policy * pol = ch->pol.tmax ? &ch->pol : &conf.pol;
+	if (trf->cnt++ == 0)
+		trf->first_ts = tsms;
+	if (pol->tmax) {
+		TSMS due = (pol->count && trf->cnt >= pol->count) ? tsms : trf->first_ts + pol->tmax;
+		if (due < trf->post_ts + pol->tmin)
+			due = trf->post_ts + pol->tmin;
+		trf->due = due;
+	} else if (!trf->due) {
+		TSMS iv = (TSMS)conf.interval * 1000;
+		trf->due = tsms / iv * iv + iv;
+	}
+	if (trf->due <= tsms)
+		post_tariff(ch, trf, tsms);
+	else if (!flush_ts || trf->due < flush_ts)
+		set_timer(trf->due);
+}
+
+static TSMS now_tsms() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return CALC_TSMS(tv);
+}
+
+/*** live stream ***************************************************************/
+
+static void live_open() {
+	struct sockaddr_un addr = { AF_UNIX };
+	if (strlen(conf.live) >= sizeof(addr.sun_path)) {
+		mylog("ERROR: live socket path too long: %s", conf.live);
+		return;
+	}
+	strcpy(addr.sun_path, conf.live);
+	unlink(conf.live);
+	live_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (live_fd < 0 || bind(live_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(live_fd, LIVE_CLIENTS) < 0) {
+		mylog("ERROR: live socket %s: %m", conf.live);
+		if (live_fd >= 0)
+			close(live_fd);
+		live_fd = -1;
+		return;
+	}
+	for (int i=0; i<LIVE_CLIENTS; ++i)
+		live[i].fd = -1;
+	mylog("live stream on %s", conf.live);
+}
+
+static void live_close(struct live_client * cl) {
+	DPRINT("live client %d closed", cl->fd);
+	close(cl->fd);
+	cl->fd = -1;
+	cl->len = 0;
+	cl->dropped = 0;
+}
+
+static void live_accept() {
+	int fd = accept(live_fd, NULL, NULL); // all client i/o uses MSG_DONTWAIT
+	if (fd < 0) {
+		if (errno != EAGAIN)
+			mylog("live socket accept: %m");
+		return;
+	}
+	for (int i=0; i<LIVE_CLIENTS; ++i)
+		if (live[i].fd < 0) {
+			live[i].fd = fd;
+			DPRINT("live client %d connected", fd);
+			return;
+		}
+	mylog("live socket: too many clients, connection refused");
+	close(fd);
+}
+
+// write as much buffered data to the client as the socket takes, never blocks
+static void live_write(struct live_client * cl) {
+	ssize_t rc = send(cl->fd, cl->buf, cl->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno != EAGAIN)
+			live_close(cl);
+		return;
+	}
+	cl->len -= rc;
+	memmove(cl->buf, cl->buf + rc, cl->len);
+}
+
+static void live_append(struct live_client * cl, const char * msg, size_t len) {
+	if (cl->len + len > sizeof(cl->buf)) {
+		++cl->dropped;
+		return;
+	}
+	memcpy(cl->buf + cl->len, msg, len);
+	cl->len += len;
+}
+
+// send a message line to all clients. slow clients don't get it if their buffer is full
+static void live_publish(const char * fmt, ...) __attribute__ ((format (printf, 1, 2)));
+static void live_publish(const char * fmt, ...) {
+	char msg[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= sizeof(msg))
+		return;
+	for (int i=0; i<LIVE_CLIENTS; ++i) {
+		struct live_client * cl = &live[i];
+		if (cl->fd < 0)
+			continue;
+		if (cl->dropped) { // tell the client that it missed something, as soon as there's room again
+			char note[64];
+			int nlen = snprintf(note, sizeof(note), "{\"dropped\":%lu}\n", cl->dropped);
+			if (cl->len + nlen + len > sizeof(cl->buf)) {
+				++cl->dropped;
+				continue;
+			}
+			cl->dropped = 0;
+			live_append(cl, note, nlen);
+		}
+		live_append(cl, msg, len);
+		live_write(cl);
+	}
+}
+
+// handle poll results of client sockets. input from clients is ignored
+static void live_handle(struct live_client * cl, short revents) {
+	if (revents & POLLIN) {
+		char buf[256];
+		ssize_t rc = recv(cl->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (rc == 0 || (rc < 0 && errno != EAGAIN)) {
+			live_close(cl);
+			return;
+		}
+	}
+	if (revents & (POLLERR | POLLHUP))
+		live_close(cl);
+	else if (revents & POLLOUT)
+		live_write(cl);
+}
+
+// for reference, struct input_event for mouse events:
+// type: EV_SYN EV_KEY EV_MSC
+// with type==EV_KEY:
+// code: BTN_LEFT BTN_RIGHT BTN_MIDDLE ...
+// value: 0 => released, 1 => pressed (and 2 => autorepeat)
+static void handle_event(struct input_event * ev) {
+	if (ev->type != EV_KEY) { // mouse button event?
+		DPRINT("ignoring event type %d (code 0x%03x value %d)", ev->type, ev->code, ev->value);
+		return;
+	} else
+		DPRINT("handling event type %d (code 0x%03x value %d)", ev->type, ev->code, ev->value);
+
+	struct channel * ch = b2c[ev->code];
+	if (!ch) // no channel set for button
+		return;
+	TSMS tsms = CALC_TSMS(ev->time);
+	if (ev->code == ch->btn_imp.code) { // impulse button
+		if (ev->value == 0) { // release
+			ch->pressed = 0;
+			ch->release_ts = tsms;
+			return;
+		} else if (ev->value != 1) {
+			return; // autorepeat
+		} else if (ch->pressed) {
+			DPRINT("%s: ignoring press without release", ch->peak.name);
+			return;
+		}
+		ch->pressed = 1;
+		if (conf.debounce > 0 && ch->release_ts && tsms - ch->release_ts < conf.debounce) {
+			mylog_ts(&ev->time, "%-13s: ignoring bounce (%llu ms after release)", ch->peak.name, tsms - ch->release_ts);
+			return;
+		}
+		struct tariff * trf = &ch->trf[ch->act];
+		++imp_cnt;
+		if (ch->ts && tsms > ch->ts) {
+			TSMS tdiff = tsms - ch->ts;
+			double power = (3600.0 * 1000) * ch->val / tdiff;
+			if (!opt.quiet)
+				mylog_ts(&ev->time, "%-13s: P = %7.1f W  (delta_t = %6llu ms)", trf->name, power, tdiff);
+			if (live_fd >= 0)
+				live_publish("{\"ts\":%llu,\"channel\":\"%s\",\"uuid\":\"%s\",\"power\":%.1f,\"dt\":%llu}\n",
+					tsms, trf->name, trf->uuid, power, tdiff);
+			if (ch->pwr.uuid[PWR_AVG]) {
+				struct power * pwr = &ch->pwr;
+				if (pwr->n == 0 || power < pwr->min)
+					pwr->min = power;
+				if (pwr->n == 0 || power > pwr->max)
+					pwr->max = power;
+				pwr->dt += tdiff;
+				++(pwr->n);
+			}
+		} else if (!opt.quiet) {
+			mylog_ts(&ev->time, "%-13s: first impulse", trf->name);
+		}
+		trf->ts = ch->ts = tsms;
+
+		if (conf.interval > 0 || conf.pol.tmax || ch->pol.tmax) {
+			queue_impulse(ch, trf, tsms);
+		} else {
+			vzspool(tsms, trf->uuid, ch->val);
+			power_post(ch);
+		}
+	} // s0 impulse button
+	else if (ev->code == ch->btn_trf.code) { // tariff button
+		if (ev->value == 2) {
+			DPRINT("ignoring autorepeat for button %s", ch->btn_trf.name); // keyboards repeat held keys
+		} else if (ev->value != 0 && ev->value != 1) {
+			mylog("Warning: ignoring unknown value %d for button %s", ev->value, ch->btn_trf.name);
+		} else if (ch->act != ev->value) {
+			ch->act = ev->value;
+			struct tariff * trf_cur = &ch->trf[ch->act];
+			struct tariff * trf_oth = &ch->trf[!ch->act];
+			mylog("tariff switch: %s -> %s", trf_oth->name, trf_cur->name);
+			if (trf_oth->ts)
+				vzspool(trf_oth->ts, trf_cur->uuid, 0.0); // send 0-val with last timestamp of previous tariff for _current_ tariff
+			vzspool(tsms, trf_oth->uuid, 0.0); // send 0-val with current timestamp for _previous_ tariff
+		} else {
+			mylog("Warning: tariff button %s event (%d) without state change", ch->btn_trf.name, ev->value);
+		}
+	} // tariff button
+}
+
+// write events to the capture file
+static void capture(const struct input_event * evs, int cnt) {
+	for (int i=0; i<cnt; ++i) {
+		struct cap_record rec = { (uint64_t)evs[i].time.tv_sec * 1000000 + evs[i].time.tv_usec, evs[i].type, evs[i].code, evs[i].value };
+		fwrite(&rec, sizeof(rec), 1, cap_fh);
+	}
+	if (fflush(cap_fh) != 0) {
+		mylog("ERROR: writing capture file failed, capture stopped: %m");
+		fclose(cap_fh);
+		cap_fh = NULL;
+	}
+}
+
+// the kernel buffer overran and events were lost: fetch the current key states and
+// feed the differences to our state through synthetic events with timestamp tv
+static void resync(struct timeval tv) {
+	if (replaying) // no device to ask
+		return;
+	uint64_t keys[bits64(KEY_CNT)];
+	memset(keys, 0, sizeof(keys));
+	if (ioctl(dev_fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+		mylog("resync failed, ioctl EVIOCGKEY error %m");
+		return;
+	}
+	int recovered = 0;
+	for (struct channel *ch=conf.chan; ch; ch=ch->next) {
+		struct input_event ev = { .time = tv, .type = EV_KEY };
+		int val = bit_get(keys, ch->btn_imp.code);
+		if (val != ch->pressed) {
+			ev.code = ch->btn_imp.code;
+			ev.value = val;
+			recovered += val;
+			handle_event(&ev);
+		}
+		if (ch->btn_trf.code && (val = bit_get(keys, ch->btn_trf.code)) != ch->act) {
+			ev.code = ch->btn_trf.code;
+			ev.value = val;
+			handle_event(&ev);
+		}
+	}
+	mylog("resync after event buffer overrun #%llu: %d missed impulse(s) recovered from key states, impulses may have been lost", drop_cnt, recovered);
+}
+
+// dispatch a batch of events, no matter where they come from
+static void handle_events(struct input_event * evs, int cnt) {
+	static int dropping = 0; // events are incomplete until the next SYN_REPORT after SYN_DROPPED
+	if (cap_fh)
+		capture(evs, cnt);
+	for (int i=0; i<cnt; ++i) {
+		struct input_event * ev = &evs[i];
+		if (replaying)
+			flush_due(CALC_TSMS(ev->time));
+		if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+			++drop_cnt;
+			dropping = 1;
+			mylog_ts(&ev->time, "WARNING: event buffer overrun (SYN_DROPPED), %llu so far", drop_cnt);
+		} else if (dropping) {
+			if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+				dropping = 0;
+				resync(ev->time);
+			}
+		} else
+			handle_event(ev);
+	}
+	ev_cnt += cnt;
+}
+
+// read all pending events from the device
+static void read_events() {
+	while (1) {
+		ssize_t rc = read(dev_fd, evbuf, evbuf_size * sizeof(*evbuf));
+		if (rc == 0) {
+			mylog("read: EOF??");
+			reopen_device();
+			return;
+		} else if (rc < 0) {
+			if (errno != EAGAIN) {
+				mylog("read error: %m");
+				reopen_device();
+			} else
+				DPRINT("read EAGAIN");
+			return;
 		}
-		trf = &ch->offpeak;
-		if (trf->cnt > 0) {
-			DPRINT("spooled offpeak channel %s UUID %s ts %lld cnt %d", trf->name, trf->uuid, trf->ts, trf->cnt);
-			vzspool(trf->ts, trf->uuid, ch->val * trf->cnt);
-			trf->cnt = 0;
+		handle_events(evbuf, rc / sizeof(*evbuf));
+		if (rc < evbuf_size * sizeof(*evbuf))
+			return; // buffer drained
+		if (evbuf_size < EVBUF_MAX) { // buffer was too small, there may be more events waiting
+			struct input_event * p = realloc(evbuf, 2 * evbuf_size * sizeof(*evbuf));
+			if (p) {
+				evbuf = p;
+				evbuf_size *= 2;
+				mylog("read buffer full, increased to %zu events", evbuf_size);
+			}
 		}
 	}
 }
 
+/*** capture replay and synthetic events *****************************************/
+
+// open a capture file for replay ("r") or to append to it ("a", created if it doesn't exist).
+// an existing file must have the header of this version and complete records
+static FILE * open_capture(const char * path, const char * mode) {
+	struct cap_header hdr = { CAP_MAGIC, CAP_VERSION, sizeof(struct cap_record) };
+	int append = *mode == 'a';
+	FILE * fh = fopen(path, append ? "a+" : "r");
+	if (!fh) {
+		mylog("ERROR: open capture file %s: %m", path);
+		return NULL;
+	}
+	long size = 0;
+	if (append && (fseek(fh, 0, SEEK_END) < 0 || (size = ftell(fh)) < 0)) {
+		mylog("ERROR: capture file %s: %m", path);
+		fclose(fh);
+		return NULL;
+	}
+	if (append && size == 0) { // new capture
+		if (fwrite(&hdr, sizeof(hdr), 1, fh) != 1 || fflush(fh) != 0) {
+			mylog("ERROR: writing capture file header failed: %m");
+			fclose(fh);
+			return NULL;
+		}
+		return fh;
+	}
+	struct cap_header got;
+	rewind(fh);
+	if (fread(&got, sizeof(got), 1, fh) != 1 || memcmp(got.magic, hdr.magic, sizeof(hdr.magic)) ||
+	    got.version != hdr.version || got.recsize != hdr.recsize) {
+		mylog("ERROR: %s is not a capture file of this version", path);
+		fclose(fh);
+		return NULL;
+	}
+	if (append) {
+		// records written after a cut off one would be read shifted
+		if ((size - sizeof(hdr)) % sizeof(struct cap_record)) {
+			mylog("ERROR: %s ends with an incomplete record, not appending to it", path);
+			fclose(fh);
+			return NULL;
+		}
+		fseek(fh, 0, SEEK_END); // switch to writing
+	}
+	return fh;
+}
+
+// sleep until the event time is reached, relative to the start of the replay
+static void replay_pace(TSMS tsms) {
+	static TSMS first, start;
+	if (!first) {
+		first = tsms;
+		start = now_tsms();
+		return;
+	}
+	TSMS due = start + (TSMS)((tsms - first) / opt.speed);
+	TSMS now = now_tsms();
+	if (due > now) {
+		struct timespec ts = { (due - now) / 1000, (due - now) % 1000 * 1000000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void replay_file(const char * path) {
+	FILE * fh = open_capture(path, "r");
+	if (!fh)
+		exit(EXIT_FAILURE);
+	struct cap_record recs[256];
+	struct input_event evs[DIM(recs)];
+	size_t got;
+	while ((got = fread(recs, sizeof(recs[0]), DIM(recs), fh)) > 0) {
+		for (size_t i=0; i<got; ++i) {
+			memset(&evs[i], 0, sizeof(evs[i]));
+			evs[i].time.tv_sec = recs[i].usec / 1000000;
+			evs[i].time.tv_usec = recs[i].usec % 1000000;
+			evs[i].type = recs[i].type;
+			evs[i].code = recs[i].code;
+			evs[i].value = recs[i].value;
+			if (opt.speed > 0) {
+				replay_pace(CALC_TSMS(evs[i].time));
+				handle_events(&evs[i], 1);
+			}
+		}
+		if (opt.speed <= 0)
+			handle_events(evs, got);
+	}
+	fclose(fh);
+}
+
+static void set_event(struct input_event * ev, TSMS tsms, uint16_t type, uint16_t code, int32_t value) {
+	ev->time.tv_sec = tsms / 1000;
+	ev->time.tv_usec = tsms % 1000 * 1000;
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+// generate opt.synth impulses for each impulse button, one every opt.synth_period ms.
+// the impulses of different channels are spread over the period, tariff buttons are not touched
+static void replay_synth() {
+	int chans = 0;
+	for (struct channel * ch=conf.chan; ch; ch=ch->next)
+		++chans;
+	if (chans == 0)
+		return;
+	struct input_event evs[4*chans]; // press+syn and release+syn
+	memset(evs, 0, sizeof(evs));
+	TSMS t0 = now_tsms() / 1000 * 1000;
+	for (long long i=0; i<opt.synth; ++i) {
+		TSMS t = t0 + i * opt.synth_period;
+		int n = 0;
+		for (struct channel * ch=conf.chan; ch; ch=ch->next) {
+			set_event(&evs[n++], t, EV_KEY, ch->btn_imp.code, 1);
+			set_event(&evs[n++], t, EV_SYN, SYN_REPORT, 0);
+			t += opt.synth_period / chans;
+		}
+		for (struct channel * ch=conf.chan; ch; ch=ch->next) {
+			t = CALC_TSMS(evs[n-2*chans].time) + 1; // release 1 ms after press
+			set_event(&evs[n++], t, EV_KEY, ch->btn_imp.code, 0);
+			set_event(&evs[n++], t, EV_SYN, SYN_REPORT, 0);
+		}
+		if (opt.speed > 0)
+			replay_pace(t0 + i * opt.synth_period);
+		handle_events(evs, n);
+	}
+}
+
+// run the replay or generator and log some benchmark numbers
+static void replay() {
+	struct timespec t1, t2;
+	replaying = 1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (opt.replay)
+		replay_file(opt.replay);
+	else
+		replay_synth();
+	dequeue(); // spool the last interval
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double dur = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	mylog("replay finished: %llu events, %llu impulses, %llu spool entries, %llu overruns in %.3f s (%.0f events/s, %.0f impulses/s)",
+		ev_cnt, imp_cnt, spool_cnt, drop_cnt, dur, dur > 0 ? ev_cnt / dur : 0, dur > 0 ? imp_cnt / dur : 0);
+}
+
+static void usage(const char * prog) {
+	fprintf(stderr, "Usage: %s [options] </path/to/s0.conf>\n"
+		"  -w <file>       capture all events read from the device to <file>\n"
+		"  -r <file>       replay events from capture <file> instead of reading the device\n"
+		"  -g <n>[:<ms>]   generate <n> impulses per channel, one every <ms> (default 100) ms\n"
+		"  -x <speed>      replay speed factor (default 0: as fast as possible)\n"
+		"  -o <path/>      spool path for -r and -g (default: dry run, the spool entries are\n"
+		"                  printed to stdout and the spool of the config is not touched)\n"
+		"  -q              don't log single impulses\n", prog);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[])
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s </path/to/s0.conf>\n", argv[0]);
-		exit(EXIT_FAILURE);
+	int o;
+	opt.synth_period = 100;
+	while ((o = getopt(argc, argv, "w:r:g:x:o:q")) != -1) {
+		char * endptr;
+		switch (o) {
+		case 'w': opt.capture = optarg; break;
+		case 'r': opt.replay = optarg; break;
+		case 'g':
+			opt.synth = strtoll(optarg, &endptr, 10);
+			if (*endptr == ':')
+				opt.synth_period = strtol(endptr+1, &endptr, 10);
+			if (*endptr != '\0' || opt.synth <= 0 || opt.synth_period <= 0)
+				usage(argv[0]);
+			break;
+		case 'x': opt.speed = atof(optarg); break;
+		case 'o': opt.spool = optarg; break;
+		case 'q': opt.quiet = 1; break;
+		default: usage(argv[0]);
+		}
 	}
-	if (!read_config(argv[1], &conf)) {
+	if (optind >= argc || (opt.spool && !opt.replay && !opt.synth))
+		usage(argv[0]);
+	if (!read_config(argv[optind], &conf)) {
 		exit(EXIT_FAILURE);
 	}
+
+	if (opt.replay || opt.synth) {
+		// test runs must not post fake readings with a production config
+		free(conf.spool);
+		conf.spool = strdup(opt.spool ? opt.spool : "");
+		dry_run = !opt.spool;
+	}
+	mylog("%s %s (spool dir %s)", argv[0], VER, dry_run ? "none, dry run to stdout" : conf.spool);
+	mylog("source ts: %s  compile ts: %s", SOURCE_TS, COMPILE_TS);
+
+	if (opt.replay || opt.synth) {
+		replay();
+		exit(EXIT_SUCCESS);
+	}
 	if (!conf.dev) {
 		mylog("ERROR: no input device in config");
 		exit(EXIT_FAILURE);
 	}
 
-	mylog("%s %s (spool dir %s)", argv[0], VER, conf.spool);
-	mylog("source ts: %s  compile ts: %s", SOURCE_TS, COMPILE_TS);
-
 	{ // install signal handlers
 		struct sigaction action;
 		memset(&action, 0, sizeof(struct sigaction));
@@ -397,122 +1137,57 @@ int main(int argc, char* argv[])
 		sigaction(SIGHUP, &action, NULL);
 	}
 
+	int queued = (conf.interval > 0 || conf.pol.tmax);
+	for (struct channel * ch=conf.chan; ch; ch=ch->next)
+		queued |= (ch->pol.tmax > 0);
+	if (queued) {
+		// the timer uses wall clock time (like the event timestamps), so spool intervals are aligned to full <interval> seconds
+		timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0) {
+			mylog("ERROR: timerfd_create: %m");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opt.capture && !(cap_fh = open_capture(opt.capture, "a")))
+		exit(EXIT_FAILURE);
+
+	if (conf.live)
+		live_open();
+
 	/* start main task */
 	reopen_device();
 
-	time_t next_spool_time = 0;
-	if (conf.interval > 0)
-		next_spool_time = time(NULL) / conf.interval * conf.interval + conf.interval;
-	int ready = (conf.interval == 0); // poll result. set to fixed value 1 if spool interval is not set
-	int spool = 0; // do we have events to send to spool?
+	// device, timer, live socket and live clients. negative fds (unused) are ignored by poll
+	struct pollfd fds[3+LIVE_CLIENTS] = { { dev_fd, POLLIN, 0 }, { timer_fd, POLLIN, 0 }, { live_fd, POLLIN, 0 } };
 	while (1) {
-		if (conf.interval > 0) 
-		do {
-			// calculate next interval
-			struct timeval tv = {0, 0};
-			struct pollfd fds[1] = { {dev_fd, POLLIN, 0} };
-			int timeout;
-			if (gettimeofday(&tv, NULL) != 0) {
-				mylog("WARNING! gettimeofday: %m");
-				tv.tv_sec = time(NULL);
-				if (tv.tv_sec == -1)
-					tv.tv_sec = next_spool_time - 1;
-				tv.tv_usec = 500000; //
-			}
-			if (spool) {
-				if (tv.tv_sec < next_spool_time)
-					timeout = (next_spool_time - tv.tv_sec) * 1000 - tv.tv_usec / 1000;
-				else
-					timeout = 0; // poll events, but return immediately
-			} else
-				timeout = -1; // nothing to spool, so just wait for the next event
-			DPRINT("waiting for event, timeout %d ms", timeout);
-			ready = poll(fds, 1, timeout);
-			if (ready < 0)
+		fds[0].fd = dev_fd; // may have changed by reopen
+		for (int i=0; i<LIVE_CLIENTS && live_fd >= 0; ++i) {
+			fds[3+i].fd = live[i].fd;
+			fds[3+i].events = POLLIN | (live[i].len ? POLLOUT : 0);
+		}
+		int ready = poll(fds, live_fd >= 0 ? DIM(fds) : 3, -1);
+		if (ready < 0) {
+			if (errno != EINTR)
 				mylog("ERROR! poll: %m");
-
-			// send stored events to spool? timeout >= 0 means there is something to spool (set above)
-			if (timeout == 0 || (tv.tv_sec = time(NULL)) >= next_spool_time) { // hammertime!
-				DPRINT("spool time reached, %d events queued", spool);
-				if (spool) {
-					spool = 0;
-					dequeue();
-				}
-				while (next_spool_time <= tv.tv_sec)
-					next_spool_time += conf.interval;
-				DPRINT("spooling finished, next spool time: %ld (%s)", next_spool_time, strtime(&(struct timeval){next_spool_time, 0}));
-			}
-		} while (ready <= 0);
-
-		if (conf.read_wait.tv_nsec > 0)
-			nanosleep(&conf.read_wait, NULL);
-		struct input_event evs[16]; // mouse input events usually come in packets of 2 (EV_MSC+EV_KEY+EV_SYN), we read a multiple of it
-		ssize_t rc = read(dev_fd, evs, sizeof(evs));
-		if (rc == 0) {
-			mylog("read: EOF??");
-			reopen_device();
-			continue;
-		} else if (rc < 0) {
-			if (errno != EAGAIN) {
-				mylog("read error: %m");
-				reopen_device();
-			} else
-				DPRINT("read EAGAIN");
 			continue;
 		}
-
-		// for reference, struct input_event for mouse events:
-		// type: EV_SYN EV_KEY EV_MSC
-		// with type==EV_KEY:
-		// code: BTN_LEFT BTN_RIGHT BTN_MIDDLE ...
-		// value: 0 => released, 1 => pressed (and 2 => autorepeat)
-
-		int cnt = rc / sizeof(evs[0]);
-		for (int i=0; i<cnt; ++i) {
-			struct input_event *ev = &evs[i];
-			if (ev->type != EV_KEY) { // mouse button event?
-				DPRINT("ignoring event type %d (code 0x%03x value %d)", ev->type, ev->code, ev->value);
-				continue;
+		if (fds[1].revents & POLLIN) {
+			uint64_t expired;
+			if (read(timer_fd, &expired, sizeof(expired)) < 0 && errno == ECANCELED) {
+				mylog("system clock was changed, spooling queued impulses now");
+				dequeue();
 			} else
-				DPRINT("handling event type %d (code 0x%03x value %d)", ev->type, ev->code, ev->value);
-
-			struct channel * ch = b2c[ev->code];
-			if (ch) { // channel set for button?
-				if (ev->value == 1 && ch->btn_imp && ch->btn_imp->code == ev->code) { // impulse for channel
-					struct tariff * trf = &ch->trf[ch->act];
-					TSMS tsms = CALC_TSMS(ev->time);
-					if (trf->ts) {
-						TSMS tdiff = tsms - trf->ts;
-						double power = (3600.0 * 1000) * ch->val / tdiff;
-						mylog_ts(&ev->time, "%-13s: P = %7.1f W  (delta_t = %6llu ms)", trf->name, power, tdiff);
-					} else {
-						mylog_ts(&ev->time, "%-13s: first impulse", trf->name);
-					}
-					trf->ts = tsms;
-
-					if (conf.interval > 0) {
-						++(trf->cnt);
-						++spool;
-					} else
-						vzspool(tsms, trf->uuid, ch->val);
-				} // s0 impulse button
-				else if (ch->btn_trf && ev->code == ch->btn_trf->code) { // tariff button
-					if (ev->value != 0 && ev->value != 1) {
-						mylog("Warning: ignoring unknown value %d for button %s", ev->value, ch->btn_trf->name);
-					} else if (ch->act != ev->value) {
-						ch->act = ev->value;
-						struct tariff * trf_cur = &ch->trf[ch->act];
-						struct tariff * trf_oth = &ch->trf[!ch->act];
-						mylog("tariff switch: %s -> %s", trf_oth->name, trf_cur->name);
-						if (trf_oth->ts)
-							vzspool(trf_oth->ts, trf_cur->uuid, 0.0); // send 0-val with last timestamp of previous tariff for _current_ tariff
-						vzspool(CALC_TSMS(ev->time), trf_oth->uuid, 0.0); // send 0-val with current timestamp for _previous_ tariff
-					} else {
-						mylog("Warning: tariff button %s event (%d) without state change", ch->btn_trf->name, ev->value);
-					}
-				} // tariff button
-			} // button channel
-		} // loop over read events
+				flush_due(now_tsms());
+		}
+		if (fds[0].revents)
+			read_events(); // also handles errors (POLLERR, POLLHUP)
+		if (live_fd >= 0) {
+			for (int i=0; i<LIVE_CLIENTS; ++i)
+				if (fds[3+i].revents && live[i].fd >= 0)
+					live_handle(&live[i], fds[3+i].revents);
+			if (fds[2].revents & POLLIN)
+				live_accept();
+		}
 	} // loop forever
 } // main
-
@@ -9,8 +9,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include "log.h"
 #include "thz_com.h"
+#include "thz_decode.h"
 
 #include "thz2vzs_ts.h"
 
@@ -33,22 +35,37 @@ struct datadef {
 	int decimals;
 	char * uuid;
 	double trigger;
+	BUF req; // request code of the reply that contains the value
+	int field; // index in the decode plan of the request
+	unsigned long long interval; // ms between reads of the value, 0: read_interval
+	long long due; // next read (monotonic ms)
 	// store values from last run
 	double lval; // last read value
 	double pval; // last posted value
 	unsigned long long lts; // timestamp of last read value
 	unsigned long long pts; // timestamp of last posted value
 	unsigned int posted : 1;
+	unsigned int outside : 1; // pos is after the end of the reply (logged once)
 	struct datadef * next;
 };
 
+// request polled for the defs with its code, as often as the fastest of them needs it
+struct reqdef {
+	BUF code;
+	unsigned long long interval; // ms
+	long long due; // next request (monotonic ms)
+	struct thz_plan * plan; // fields of the defs
+	struct reqdef * next;
+};
+
 struct config_t {
 	char * log;
 	char * spool;
 	char * port;
-	unsigned long long read_interval;
+	unsigned long long read_interval; // ms
 	unsigned long long min_post_interval;
 	struct datadef * def;
+	struct reqdef * req;
 };
 
 // config is global
@@ -84,7 +101,7 @@ const char * CONF_SEP = " \r\n";
 struct config_t * read_config(char * conffile, struct config_t * conf) {
 	// set default values
 	memset(conf, 0, sizeof(*conf));
-	conf->read_interval = 60;
+	conf->read_interval = 60000;
 
 	FILE * fh = fopen(conffile, "r");
 	if (!fh) {
@@ -118,8 +135,8 @@ struct config_t * read_config(char * conffile, struct config_t * conf) {
 				mylog("config error in line %d (port)", lines);
 		} else if (!strcmp(c, "read_interval")) {
 			char * s, *endptr;
-			if (CONFIG_ELEM_PTR(c, s) && (conf->read_interval=strtoll(s, &endptr, 10)*1e6) > 0 && *endptr == 0) {
-				DPRINT("line %d: read_interval %llu us", lines, conf->read_interval);
+			if (CONFIG_ELEM_PTR(c, s) && (conf->read_interval=strtoll(s, &endptr, 10)*1e3) > 0 && *endptr == 0) {
+				DPRINT("line %d: read_interval %llu ms", lines, conf->read_interval);
 			} else {
 				mylog("config error in line %d (port)", lines);
 			}
@@ -130,23 +147,48 @@ struct config_t * read_config(char * conffile, struct config_t * conf) {
 			} else {
 				mylog("config error in line %d (port)", lines);
 			}
+		// def <pos> <name> <decimals> [<uuid> <threshold>] [req <code>] [every <s>]
 		} else if (!strcmp(c, "def")) {
 			struct datadef * def = myalloc(sizeof(struct datadef));
-			char * pos, *dec, *trig;
-			int ok = 1;
+			char * pos, *dec, *arg;
+			int ok = 1, trig = 0;
+			def->req = REQ_GLOBAL;
 			if (CONFIG_ELEM_PTR(c, pos) && CONFIG_ELEM(c, def->name) && CONFIG_ELEM_PTR(c, dec)) {
 				def->pos = atoi(pos);
 				def->decimals = atoi(dec);
-				if (CONFIG_ELEM(c, def->uuid) && CONFIG_ELEM_PTR(c, trig)) {
-					def->trigger = atof(trig);
-					++pdefs;
+				while (ok && (c = strtok(NULL, CONF_SEP))) {
+					char * opt = c;
+					if (!strcmp(opt, "req") || !strcmp(opt, "every")) {
+						if (!CONFIG_ELEM_PTR(c, arg))
+							ok = 0;
+						else if (opt[0] == 'r')
+							def->req = strtol(arg, NULL, 0);
+						else if (atof(arg) > 0)
+							def->interval = atof(arg) * 1e3;
+						else
+							ok = 0;
+					} else if (!def->uuid) {
+						def->uuid = strdup(c);
+						++pdefs;
+					} else if (!trig) {
+						def->trigger = atof(c);
+						trig = 1;
+					} else {
+						ok = 0;
+					}
+					if (!ok)
+						mylog("config error in line %d (def option '%s')", lines, opt);
 				}
 			} else {
-				ok = 1;
+				ok = 0;
 			}
 			// TODO: check for valid ranges of pos, decimals and trigger
+			if (ok && (def->decimals < -8 || def->decimals > 3)) {
+				mylog("config error in line %d (def decimals %d)", lines, def->decimals);
+				ok = 0;
+			}
 			if (ok) {
-				DPRINT("line %d: pos %d name %s decimals %d uuid %s trigger %g", lines, def->pos, def->name, def->decimals, def->uuid, def->trigger);
+				DPRINT("line %d: pos %d name %s decimals %d uuid %s trigger %g req %02hhx every %llu ms", lines, def->pos, def->name, def->decimals, def->uuid, def->trigger, def->req, def->interval);
 				*def0 = def;
 				def0 = &def->next;
 				++defs;
@@ -159,6 +201,48 @@ struct config_t * read_config(char * conffile, struct config_t * conf) {
 	}
 	//mylog("config has %d value definitions (%d will be posted)", defs, pdefs);
 	fclose(fh);
+
+	// one request per code for its defs
+	for (struct datadef * def = conf->def; def; def=def->next) {
+		if (!def->interval)
+			def->interval = conf->read_interval;
+		struct reqdef * rq;
+		for (rq = conf->req; rq && rq->code != def->req; rq=rq->next) { }
+		if (!rq) {
+			rq = myalloc(sizeof(struct reqdef));
+			rq->code = def->req;
+			rq->interval = def->interval;
+			rq->next = conf->req;
+			conf->req = rq;
+		}
+		if (def->interval < rq->interval)
+			rq->interval = def->interval;
+	}
+	// decode plan per request, built from the fields of its defs
+	for (struct reqdef * rq = conf->req; rq; rq=rq->next) {
+		int n = 0;
+		for (struct datadef * def = conf->def; def; def=def->next)
+			n += def->req == rq->code;
+		struct thz_field * fields = myalloc((n + 1) * sizeof(struct thz_field));
+		n = 0;
+		for (struct datadef * def = conf->def; def; def=def->next) {
+			if (def->req != rq->code)
+				continue;
+			struct thz_field * f = &fields[n];
+			f->pos = def->pos;
+			f->name = def->name;
+			if (def->decimals >= 0) {
+				f->width = 2;
+				f->digits = def->decimals;
+			} else { // bit -decimals-1
+				f->bit = - def->decimals - 1;
+			}
+			def->field = n++;
+		}
+		fields[n].pos = -1;
+		rq->plan = thz_plan_new(fields);
+		free(fields);
+	}
 	return conf;
 }
 
@@ -195,6 +279,79 @@ int trigger(struct datadef * def, double val) {
 	return 0; // trigger == 0 means no trigger set
 }
 
+// monotonic clock in ms for the poll deadlines
+long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// next deadline after due, missed ones are skipped, so the read time doesn't add up
+long long next_due(long long due, unsigned long long interval, long long now)
+{
+	due += interval;
+	if (due <= now)
+		due += ((now - due) / interval + 1) * interval;
+	return due;
+}
+
+// send request rq and handle its defs that are due. returns 0 if the reply is bad
+int poll_req(struct reqdef * rq, long long now)
+{
+	BUF buf[1024];
+	char str[1024];
+	size_t len = 0;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned long long ts = (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	setproctitle("reading...");
+	int got = req(rq->code, buf, sizeof(buf));
+	if (got < thz_reply_min(rq->code)) {
+		mylog("data of request %02hhx too short (%d)", rq->code, got);
+		return 0;
+	}
+	if (!thz_plan_update(rq->plan, buf, got))
+		DPRINT("request %02hhx: no value changed", rq->code);
+	for (struct datadef * def = conf.def; def; def=def->next) {
+		if (def->req != rq->code || def->due > now)
+			continue;
+		def->due = next_due(def->due, def->interval, now);
+
+		double val = thz_plan_value(rq->plan, def->field);
+		if (isnan(val)) { // not in this reply
+			if (!def->outside)
+				mylog("%s at %d is not in the reply of request %02hhx (%d bytes), skipped", def->name, def->pos, rq->code, got);
+			def->outside = 1;
+			continue;
+		}
+		def->outside = 0;
+		// a value that didn't change since the last read can't trigger a post
+		int chg = thz_plan_changed(rq->plan, def->field);
+
+		if (def->uuid && ((conf.min_post_interval && ts-def->pts > conf.min_post_interval) || (chg && trigger(def, val))))
+		{
+			if (!def->posted && def->lts)
+				vzspool(def->lts, def->uuid, def->lval);
+			def->posted = 1;
+			vzspool(ts, def->uuid, val);
+			def->pval = val;
+			def->pts = ts;
+		} else {
+			def->posted = 0;
+		}
+		def->lval = val;
+		def->lts = ts;
+		// log the changed and posted values only
+		if (chg || def->posted)
+			len += snprintf(str+len, sizeof(str)-len, "%c%s %*.*f  ", (def->posted ? '*' : ' '), def->name, def->decimals + 3, def->decimals, val);
+	}
+	if (len > 0)
+		mylog("%s", str);
+	return 1;
+}
+
 int main(int argc, char * argv[])
 {
 	if (argc < 2) {
@@ -238,55 +395,38 @@ int main(int argc, char * argv[])
 
 	BUF buf[1024];
 	if (req(0xfd, buf, sizeof(buf)) >= 2)
-		mylog("version: %.2f", fp(buf, 2));
+		mylog("version: %.2f", thz_decode(buf, &thz_firmware));
 
 	setbuf(stdout, NULL); // disable buffering on stdout
+	long long start = now_ms();
+	for (struct reqdef * rq = conf.req; rq; rq=rq->next)
+		rq->due = start;
+	for (struct datadef * def = conf.def; def; def=def->next)
+		def->due = start;
+	// poll the requests at their deadlines. requests that are due together are sent back to back
 	while (1) {
-		char str[1024];
-		size_t len = 0;
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		unsigned long long ts = (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
-
-		setproctitle("reading...");
-		int got = req(0xfb, buf, sizeof(buf));
-		if (got < 77) {
-			mylog("data too short (%d)", got);
-			reopen_com(conf.port);
-		} else {
-			for (struct datadef * def = conf.def; def; def=def->next) {
-				if (def->pos > got-2)
-					continue;
-
-				double val = fp(buf+def->pos, def->decimals);
-
-				if (def->uuid && ((conf.min_post_interval && ts-def->pts > conf.min_post_interval) || trigger(def, val)))
-				{
-					if (!def->posted && def->lts)
-						vzspool(def->lts, def->uuid, def->lval);
-					def->posted = 1;
-					vzspool(ts, def->uuid, val);
-					def->pval = val;
-					def->pts = ts;
-				} else {
-					def->posted = 0;
-				}
-				def->lval = val;
-				def->lts = ts;
-				len += snprintf(str+len, sizeof(str)-len, "%c%s %*.*f  ", (def->posted ? '*' : ' '), def->name, def->decimals + 3, def->decimals, val);
-			}
-			mylog("%s", str);
+		long long now = now_ms();
+		struct reqdef * next = conf.req;
+		for (struct reqdef * rq = conf.req; rq; rq=rq->next)
+			if (rq->due < next->due)
+				next = rq;
+		if (!next) {
+			mylog("ERROR: no value definitions in config");
+			exit(EXIT_FAILURE);
 		}
-		{
-			struct timeval tv2;
+		if (next->due > now) {
 			setproctitle("pausing...");
-			gettimeofday(&tv2, NULL);
-			unsigned long long dur_us = (tv2.tv_sec - tv.tv_sec) * 1e6 + (tv2.tv_usec - tv.tv_usec);
-			useconds_t sleep_us = conf.read_interval - dur_us;
-			if (sleep_us > 0)
-				usleep(sleep_us);
+			struct timespec ts = { next->due / 1000, next->due % 1000 * 1000000 };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			continue;
+		}
+		if (poll_req(next, now)) {
+			next->due = next_due(next->due, next->interval, now);
+			continue;
 		}
+		// no ping in every cycle, only to get the connection back after errors
 		setproctitle("ping");
+		reopen_com(conf.port);
 		while (!ping()) {
 			mylog("ping failed, trying to reopen %s in 10s...", conf.port);
 			sleep(10);
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "thz_com.h"
+
+// thz_broker: owns the serial port of the heat pump and serves the requests of thz2vzs and
+// the other tools on a unix socket. identical requests within the ttl are answered from
+// the cache, so the tools don't wait for each other and don't repeat bus transactions
+
+#define PROG "thz_broker"
+
+#if 0
+#define DPRINT(format, args...) mylog("%s: "format, __FUNCTION__, ##args)
+#else
+#define DPRINT(format, args...) do { /* nothing */ } while (0)
+#endif
+
+#define MAX_CLIENTS 16
+#define CACHE_SIZE 16
+#define CMD_MAX 8
+// default time to live of cached replies in ms
+#define DEFAULT_TTL 1000
+// wait between attempts to reopen the port after errors, doubled up to the max (ms)
+#define REOPEN_MIN 1000
+#define REOPEN_MAX 60000
+
+struct cache {
+	BUF cmd[CMD_MAX];
+	size_t cmdlen;
+	long long ts; // monotonic ms, 0 if unused
+	int len;
+	BUF data[1024];
+};
+
+static struct cache cache[CACHE_SIZE];
+static long long ttl = DEFAULT_TTL;
+static long long last_ok; // last successful bus transaction
+static unsigned long requests, hits, errors;
+static const char * sockpath;
+// the port failed, requests get errors until it is reopened at reopen_at
+static int port_down;
+static long long reopen_at, reopen_wait;
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void handle_sig(int signum) {
+	if (signum == SIGHUP) {
+		mylog("reload on SIGHUP is not implemented yet");
+		return;
+	}
+	mylog("exit on signal %d (%s), %lu requests, %lu from cache, %lu errors", signum, strsignal(signum), requests, hits, errors);
+	unlink(sockpath);
+	exit(EXIT_SUCCESS);
+}
+
+// cached reply to cmd that is still valid, or the slot to store it in (ts is 0 then)
+static struct cache * cache_find(const BUF * cmd, size_t cmdlen, long long now)
+{
+	struct cache * oldest = &cache[0];
+	for (int i=0; i<CACHE_SIZE; ++i) {
+		struct cache * c = &cache[i];
+		if (c->ts && c->cmdlen == cmdlen && !memcmp(c->cmd, cmd, cmdlen)) {
+			if (now - c->ts < ttl)
+				return c;
+			oldest = c;
+			break;
+		}
+		if (c->ts < oldest->ts)
+			oldest = c;
+	}
+	memcpy(oldest->cmd, cmd, cmdlen);
+	oldest->cmdlen = cmdlen;
+	oldest->ts = 0;
+	return oldest;
+}
+
+// the port failed: close it and let the main loop reopen it, with a growing wait if it fails again
+static void port_failed(long long now)
+{
+	close_com();
+	port_down = 1;
+	reopen_wait = reopen_wait ? reopen_wait * 2 : REOPEN_MIN;
+	if (reopen_wait > REOPEN_MAX)
+		reopen_wait = REOPEN_MAX;
+	reopen_at = now + reopen_wait;
+	last_ok = 0;
+}
+
+// serve one request, the reply is written to out. returns the reply size
+static size_t handle(const BUF * msg, size_t len, BUF * out, size_t outsize)
+{
+	int rc = -1;
+	size_t datalen = 0;
+	long long now = now_ms();
+	BUF * data = out + sizeof(rc);
+	++requests;
+	if (port_down && msg[0] != BROKER_GET) {
+		// only cached replies while the port is down
+		++errors;
+		memcpy(out, &rc, sizeof(rc));
+		return sizeof(rc);
+	}
+	switch (msg[0]) {
+	case BROKER_PING:
+		// any reply within the ttl proves the connection, no bus transaction needed
+		if (last_ok && now - last_ok < ttl) {
+			++hits;
+			rc = 1;
+		} else if ((rc = ping())) {
+			last_ok = now_ms();
+		} else {
+			mylog("ping failed, reopening the port");
+			port_failed(now);
+		}
+		break;
+	case BROKER_GET: {
+		if (len < 2 || len-1 > CMD_MAX || outsize - sizeof(rc) < sizeof(cache[0].data))
+			break;
+		struct cache * c = cache_find(msg+1, len-1, now);
+		if (c->ts) {
+			++hits;
+		} else if (port_down) {
+			c->len = -1;
+		} else if ((c->len = req2(msg+1, len-1, c->data, sizeof(c->data))) >= 0) {
+			c->ts = last_ok = now_ms();
+			reopen_wait = 0;
+		} else {
+			// the client gets the error now, the port is reopened from the main loop
+			mylog("request %02hhx failed, reopening the port", msg[1]);
+			port_failed(now);
+		}
+		if ((rc = c->len) > 0) {
+			memcpy(data, c->data, rc);
+			datalen = rc;
+		}
+		break;
+	}
+	case BROKER_SET:
+		if (len < 2)
+			break;
+		if ((rc = thz_set(msg[1], (BUF *)msg+2, len-2)) > 0)
+			last_ok = now_ms();
+		// cached values of the set code are outdated now
+		for (int i=0; i<CACHE_SIZE; ++i)
+			if (cache[i].cmdlen == 1 && cache[i].cmd[0] == msg[1])
+				cache[i].ts = 0;
+		break;
+	default:
+		EPRINT("unknown request %02hhx (%zu bytes)", msg[0], len);
+	}
+	if (rc < 0)
+		++errors;
+	memcpy(out, &rc, sizeof(rc));
+	return sizeof(rc) + datalen;
+}
+
+int main(int argc, char * argv[])
+{
+	int o;
+	while ((o = getopt(argc, argv, "t:l:")) != -1) {
+		switch (o) {
+		case 't': ttl = atoll(optarg); break;
+		case 'l': mylog_logpath(optarg); break;
+		default: argc = 0;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: %s [-t <ttl ms>] [-l <log file>] <serial device> <socket>\n", argv[0]);
+		exit(1);
+	}
+	const char * port = argv[optind];
+	sockpath = argv[optind+1];
+	mylog_progname(PROG);
+
+	struct sockaddr_un addr = { AF_UNIX };
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		mylog("socket path too long: %s", sockpath);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, sockpath);
+	int lfd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	unlink(sockpath);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, MAX_CLIENTS) < 0) {
+		mylog("socket %s: %s", sockpath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	{ // install signal handlers
+		struct sigaction action;
+		memset(&action, 0, sizeof(struct sigaction));
+		action.sa_handler = handle_sig;
+		sigaction(SIGTERM, &action, NULL);
+		sigaction(SIGQUIT, &action, NULL);
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGHUP, &action, NULL);
+	}
+
+	if (!open_com(port)) {
+		mylog("could not open %s: %s", port, strerror(errno));
+		port_failed(now_ms());
+	}
+	mylog("serving %s on %s, cache ttl %lld ms", port, sockpath, ttl);
+
+	// fds[0] is the listening socket, then the clients
+	struct pollfd fds[1 + MAX_CLIENTS];
+	int nfds = 1;
+	fds[0].fd = lfd;
+	fds[0].events = POLLIN;
+	while (1) {
+		int timeout = -1;
+		if (port_down) {
+			long long now = now_ms();
+			if (now >= reopen_at) {
+				if (open_com(port)) {
+					port_down = 0;
+				} else {
+					int err = errno;
+					port_failed(now);
+					mylog("could not open %s (retry in %llds): %s", port, reopen_wait / 1000, strerror(err));
+					continue;
+				}
+			} else {
+				timeout = reopen_at - now;
+			}
+		}
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			mylog("poll: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		// one request per client and round, so no client can hold up the others
+		for (int i=1; i<nfds; ++i) {
+			if (!fds[i].revents)
+				continue;
+			BUF msg[BROKER_MSGSIZE], out[BROKER_MSGSIZE];
+			ssize_t len = recv(fds[i].fd, msg, sizeof(msg), MSG_DONTWAIT);
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (len <= 0) { // disconnected
+				DPRINT("client %d closed", fds[i].fd);
+				close(fds[i].fd);
+				fds[i--] = fds[--nfds];
+				continue;
+			}
+			size_t n = handle(msg, len, out, sizeof(out));
+			if (send(fds[i].fd, out, n, MSG_NOSIGNAL) < 0)
+				DPRINT("send: %m");
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(lfd, NULL, NULL);
+			if (fd < 0) {
+				mylog("accept: %s", strerror(errno));
+			} else if (nfds > MAX_CLIENTS) {
+				mylog("too many clients");
+				close(fd);
+			} else {
+				DPRINT("client %d connected", fd);
+				fds[nfds].fd = fd;
+				fds[nfds].events = POLLIN;
+				fds[nfds++].revents = 0;
+			}
+		}
+	}
+}
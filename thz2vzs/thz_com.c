@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <poll.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "log.h"
 #include "thz_com.h"
@@ -23,6 +25,12 @@
 
 #define REOPEN_WAITTIME 10
 #define POLL_TIMEOUT 2
+// the broker may have to reopen the port
+#define BROKER_TIMEOUT 30
+// receive ring buffer size, power of 2
+#define RING_SIZE 1024
+// max size of an unescaped reply frame
+#define FRAME_SIZE 1024
 
 #define EPRINT(format, args...) mylog("%s: "format, __FUNCTION__, ##args)
 
@@ -42,24 +50,80 @@
 
 // serial device file descriptor
 static int com_fd = -1;
+// connected to thz_broker instead of the device
+static int broker;
+// socket path of the broker, for reconnects
+static char broker_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
 static struct pollfd pollfds = { -1, POLLIN, 0 };
 
+// received bytes not used yet. head and tail run freely, the index is masked
+static struct {
+	BUF buf[RING_SIZE];
+	size_t head, tail;
+} ring;
+
+// reply frame decoder, resumable at any byte
+struct frame {
+	enum { FRAME_DATA, FRAME_DLE, FRAME_2B, FRAME_DONE, FRAME_ERROR } state;
+	size_t len;
+	BUF sum; // checksum of the unescaped bytes so far (without the checksum byte and the terminator)
+	BUF buf[FRAME_SIZE];
+};
+
 /*********************************************************************************/
+// connect to the broker socket at path
+static int connect_broker(const char * path) {
+	struct sockaddr_un addr = { AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
 void reopen_com(const char * port) {
 	if (com_fd >= 0) {
 		mylog("device already open, closing");
 		close(com_fd);
 		sleep(1);
 	}
-	while (1) {
-		mylog("opening %s", port);
-		com_fd = open(port, O_RDWR|O_NONBLOCK|O_NOCTTY); // |O_CLOEXEC);
-		if (com_fd >= 0)
-			break;
+	struct stat st;
+	broker = stat(port, &st) == 0 && S_ISSOCK(st.st_mode);
+	if (broker)
+		snprintf(broker_path, sizeof(broker_path), "%s", port);
+	while (broker) {
+		com_fd = connect_broker(port);
+		pollfds.fd = com_fd;
+		if (com_fd >= 0) {
+			mylog("connected to broker %s", port);
+			return;
+		}
+		mylog("could not connect to broker %s (retry in 10s): %s (%d)", port, strerror(errno), errno);
+		sleep(REOPEN_WAITTIME);
+	}
+	while (!open_com(port)) {
 		mylog("could not open %s (retry in 10s): %s (%d)", port, strerror(errno), errno);
 		sleep(REOPEN_WAITTIME);
 	}
+}
+
+int open_com(const char * port) {
+	close_com();
+	broker = 0;
+	mylog("opening %s", port);
+	com_fd = open(port, O_RDWR|O_NONBLOCK|O_NOCTTY); // |O_CLOEXEC);
+	if (com_fd < 0)
+		return 0;
 	pollfds.fd = com_fd;
+	ring.head = ring.tail = 0;
 
 	struct termios newtio;
 	memset(&newtio, 0, sizeof(newtio)); /* clear struct for new port settings */
@@ -69,10 +133,71 @@ void reopen_com(const char * port) {
 	tcsetattr(com_fd, TCSANOW, &newtio);
 
 	mylog("opened %s", port);
+	return 1;
+}
+
+void close_com() {
+	if (com_fd >= 0)
+		close(com_fd);
+	com_fd = pollfds.fd = -1;
+}
+
+// drop the connection to the broker after a failed call and connect again, so a late
+// reply to that call can't be taken for the reply to the next one
+static void broker_reconnect()
+{
+	close_com();
+	com_fd = pollfds.fd = connect_broker(broker_path);
+	if (com_fd < 0)
+		EPRINT("reconnect to %s failed: %m", broker_path);
+}
+
+// send a request to the broker and wait for its reply. returns the rc of the broker
+static int broker_call(BUF op, const BUF * cmd, size_t cmdlen, BUF * outbuf, size_t bufsize)
+{
+	BUF msg[BROKER_MSGSIZE];
+	if (1 + cmdlen > sizeof(msg))
+		return -1;
+	if (com_fd < 0) { // the last reconnect failed
+		broker_reconnect();
+		if (com_fd < 0)
+			return -1;
+	}
+	msg[0] = op;
+	memcpy(msg+1, cmd, cmdlen);
+	if (send(com_fd, msg, 1 + cmdlen, MSG_NOSIGNAL) < 0) {
+		EPRINT("send: %m");
+		broker_reconnect();
+		return -1;
+	}
+	if (poll(&pollfds, 1, BROKER_TIMEOUT*1000) <= 0) {
+		EPRINT("broker timeout");
+		broker_reconnect();
+		return -1;
+	}
+	ssize_t got = recv(com_fd, msg, sizeof(msg), 0);
+	int rc;
+	if (got < (ssize_t)sizeof(rc)) {
+		EPRINT("broker %s", got < 0 ? strerror(errno) : "closed the connection");
+		broker_reconnect();
+		return -1;
+	}
+	memcpy(&rc, msg, sizeof(rc));
+	if (rc > 0 && outbuf) {
+		if (rc > got - sizeof(rc) || rc > bufsize) {
+			EPRINT("bad broker reply (%d bytes of %zd)", rc, got);
+			broker_reconnect();
+			return -1;
+		}
+		memcpy(outbuf, msg + sizeof(rc), rc);
+	}
+	return rc;
 }
 
 int lock_com(int nb)
 {
+	if (broker)
+		return 0; // the broker serializes the requests
 	int rc = flock(com_fd, LOCK_EX | (nb ? LOCK_NB : 0));
 	if (rc)
 		mylog("lock(%d) failed: %m", nb);
@@ -81,6 +206,8 @@ int lock_com(int nb)
 
 int unlock_com()
 {
+	if (broker)
+		return 0;
 	return flock(com_fd, LOCK_UN);
 }
 
@@ -93,20 +220,28 @@ void dump(char * pre, BUF * buf, ssize_t len)
 	printf(" (%zd)\n", len);
 }
 
-int rx(BUF * buf, size_t bufsize)
+// bytes in the ring buffer. if it is empty, wait for data and read as much as fits.
+// returns 0 on eof, -1 on timeout or errors
+static ssize_t fill()
 {
+	if (ring.head != ring.tail)
+		return ring.head - ring.tail;
+
 	int retval = poll(&pollfds, 1, POLL_TIMEOUT*1000);
 
 	if (retval > 0) {
 		if (pollfds.revents & POLLIN) {
-			int got = read(com_fd, buf, bufsize);
+			// the ring is empty: start at its beginning, so one read gets everything that fits
+			ring.head = ring.tail = 0;
+			int got = read(com_fd, ring.buf, RING_SIZE);
 			if (got < 0) {
 				perror("rx: read()");
 			} else {
 				if (got == 0)
 					EPRINT("eof");
+				ring.head += got;
 				return got;
-			} 
+			}
 		} else if (pollfds.revents & POLLERR) {
 			EPRINT("poll reported error condition (%hd)", pollfds.revents);
 		} else {
@@ -121,6 +256,33 @@ int rx(BUF * buf, size_t bufsize)
 	return -1;
 }
 
+// contiguous bytes at the read position of the ring buffer
+static size_t ring_chunk(BUF ** p)
+{
+	size_t tail = ring.tail & (RING_SIZE-1);
+	size_t n = ring.head - ring.tail;
+	*p = ring.buf + tail;
+	return n < RING_SIZE - tail ? n : RING_SIZE - tail;
+}
+
+int rx(BUF * buf, size_t bufsize)
+{
+	ssize_t got = fill();
+	if (got <= 0)
+		return got;
+	size_t n = 0;
+	while (n < bufsize && ring.head != ring.tail) {
+		BUF * p;
+		size_t len = ring_chunk(&p);
+		if (len > bufsize - n)
+			len = bufsize - n;
+		memcpy(buf+n, p, len);
+		ring.tail += len;
+		n += len;
+	}
+	return n;
+}
+
 int rxx(BUF * buf, size_t bufsize, int want)
 {
 	size_t got = 0;
@@ -150,6 +312,8 @@ int ack()
 
 int ping()
 {
+	if (broker)
+		return broker_call(BROKER_PING, NULL, 0, NULL, 0) > 0;
 	BUF buf;
 	int got = -1;
 	lock_com(0);
@@ -178,6 +342,50 @@ BUF checksum(BUF * buf, size_t len)
 	return sum;
 }
 
+// feed received bytes to the frame decoder: DLE DLE is a DLE, 0x2b 0x18 is 0x2b and DLE ETX
+// ends the frame. returns the number of bytes used, the rest belongs to the next message
+static size_t frame_feed(struct frame * f, const BUF * in, size_t n)
+{
+	size_t i;
+	for (i=0; i<n && f->state < FRAME_DONE; ++i) {
+		BUF c = in[i];
+		switch (f->state) {
+		case FRAME_DLE:
+			if (c == DLE) {
+				f->state = FRAME_DATA; // escaped DLE, it is stored already
+				continue;
+			} else if (c == ETX) {
+				f->sum -= DLE; // the terminator is not part of the checksum
+				f->state = FRAME_DONE;
+				break;
+			}
+			EPRINT("bad escaped character %02hhx", c);
+			f->state = FRAME_ERROR;
+			continue;
+		case FRAME_2B:
+			if (c != 0x18)
+				EPRINT("bad character after 0x2b: %02hx", c);
+			f->state = FRAME_DATA;
+			continue;
+		default:
+			if (c == DLE)
+				f->state = FRAME_DLE;
+			else if (c == 0x2b)
+				f->state = FRAME_2B;
+			if (f->len != 2)
+				f->sum += c;
+			break;
+		}
+		if (f->len >= sizeof(f->buf)) {
+			EPRINT("message too long (>%zu)", sizeof(f->buf));
+			f->state = FRAME_ERROR;
+			continue;
+		}
+		f->buf[f->len++] = c;
+	}
+	return i;
+}
+
 int req(BUF cmd, BUF * outbuf, size_t bufsize)
 {
 	return req2(&cmd, 1, outbuf, bufsize);
@@ -185,6 +393,8 @@ int req(BUF cmd, BUF * outbuf, size_t bufsize)
 
 int req2(const BUF * cmd, size_t cmdlen, BUF * outbuf, size_t bufsize)
 {
+	if (broker)
+		return broker_call(BROKER_GET, cmd, cmdlen, outbuf, bufsize);
 	size_t txlen = 5 + cmdlen;
 	int got;
 	BUF buf[1024] = { SOH, CMD_GET, 0 }; 
@@ -217,78 +427,55 @@ int req2(const BUF * cmd, size_t cmdlen, BUF * outbuf, size_t bufsize)
 	write(com_fd, buf, 1);
 	DUMP("tx", buf, 1);
 
-	// rx data
-	BUF * pos = buf;
-	BUF * endpos = buf + sizeof(buf);
-	int escape = 0;
-	int skip = 0;
-	while (pos < endpos) {
-		got = rx(pos, 1);
-		if (got < 0) {
+	// rx data, decoded chunk by chunk as it is in the ring buffer
+	static struct frame f;
+	f.state = FRAME_DATA;
+	f.len = 0;
+	f.sum = 0;
+	while (f.state < FRAME_DONE) {
+		BUF * p;
+		got = fill();
+		if (got <= 0) {
 			EPRINT("data timeout (%d)", got);
-			DUMP("rx", buf, pos-buf);
+			DUMP("rx", f.buf, f.len);
 			unlock_com();
 			return -1;
-		} else if (got != 1) {
-			continue;
-		}
-		if (escape) {
-			if (*pos == DLE) {
-				escape = 0; // skip escaped DLE
-			} else if (*pos == ETX) {
-				++pos;
-				break; // end of transmission
-			} else {
-				EPRINT("bad escaped character %02hhx", *pos);
-				dump("rx", buf, pos-buf);
-				unlock_com();
-				return -1;
-			}
-		} else if (skip) {
-			if (*pos != 0x18)
-				EPRINT("bad character after 0x2b: %02hx", *pos);
-			skip = 0;
-		} else { // no special char received before
-			if (*pos == DLE)
-				escape = 1;
-			else if (*pos == 0x2b)
-				skip = 1;
-			++pos;
 		}
+		size_t n = ring_chunk(&p);
+		ring.tail += frame_feed(&f, p, n);
 	}
-	size_t len = pos-buf;
-	DUMP("rx", buf, len);
-	ack();
-	unlock_com();
-	if (pos >= endpos) {
-		EPRINT("message too long (%zu>%zu)", len, sizeof(buf));
+	size_t len = f.len;
+	DUMP("rx", f.buf, len);
+	if (f.state == FRAME_ERROR) {
+		dump("rx", f.buf, len);
+		unlock_com();
 		return -1;
 	}
+	ack();
+	unlock_com();
 
 	char * err = NULL;
-	size_t datalen = pos - buf - 6;
+	size_t datalen = len - 6;
 	if (len < 6)
 		err = "message too short";
-	else if (buf[0] != SOH)
+	else if (f.buf[0] != SOH)
 		err = "no SOH at start";
-	else if (buf[1] == 0x02) 
+	else if (f.buf[1] == 0x02)
 		err = "request checksum error";
-	else if (buf[1] != CMD_GET)
+	else if (f.buf[1] != CMD_GET)
 		err = "request error";
-	else if (*(pos-2) != DLE || *(pos-1) != ETX)
-		err = "missing terminator";
-	else if (buf[2] != checksum(buf, len-2))
+	else if (f.buf[2] != f.sum)
 		err = "reply checksum error";
 	else if (datalen > bufsize)
 		err = "buffer too small";
 
 	if (err != NULL) {
-		dump("rx", buf, len);
+		dump("rx", f.buf, len);
 		EPRINT("req error: %s", err);
 		return -1;
-	}	
+	}
 
-	memcpy(outbuf, buf+4, datalen);
+	memcpy(outbuf, f.buf+4, datalen);
 	return datalen;
 }
 
@@ -296,6 +483,14 @@ int req2(const BUF * cmd, size_t cmdlen, BUF * outbuf, size_t bufsize)
 
 int thz_set(BUF cmd, BUF * inbuf, size_t ilen)
 {
+	if (broker) {
+		BUF msg[BROKER_MSGSIZE];
+		if (1 + ilen > sizeof(msg))
+			return -1;
+		msg[0] = cmd;
+		memcpy(msg+1, inbuf, ilen);
+		return broker_call(BROKER_SET, msg, 1 + ilen, NULL, 0);
+	}
 	int got;
 	BUF buf[1024] = { SOH, CMD_SET, 0, cmd };
 
@@ -329,25 +524,3 @@ int thz_set(BUF cmd, BUF * inbuf, size_t ilen)
 	}
 	return 0;
 }
-
-
-double fp(BUF * buf, int decimals)
-{
-	if (decimals >= 0) {
-		signed short val = buf[0];
-		val <<= 8;
-		val += buf[1];
-		double f = val;
-		if (decimals == 1)
-			f /= 10;
-		else if (decimals == 2)
-			f /= 100;
-		DPRINT("%02hhx %02hhx => %hd => %f", buf[0], buf[1], val, f);
-		return f;
-	} else { // 0 < decimals <= 8
-		int shift = - decimals - 1;
-		return (*buf >> shift) & 1;
-	}
-}
-
-
@@ -7,8 +7,19 @@
 
 typedef unsigned char BUF;
 
+// thz_broker protocol on a unix seqpacket socket, one message each way.
+// request: op [cmd...] [data...], reply: int rc, rc bytes of data if rc > 0
+#define BROKER_PING 'P'
+#define BROKER_GET 'G' // req2(cmd)
+#define BROKER_SET 'S' // thz_set(cmd, data)
+#define BROKER_MSGSIZE 1100
+
 /*********************************************************************************/
+// port is a serial device or the socket of thz_broker
 void reopen_com(const char * port);
+// one attempt to open the serial device port without waiting, returns 0 if it failed (see errno)
+int open_com(const char * port);
+void close_com();
 
 int lock_com(int nb);
 int unlock_com();
@@ -30,5 +41,3 @@ int req2(const BUF * cmd, size_t cmdlen, BUF * outbuf, size_t bufsize);
 
 int thz_set(BUF, BUF *, size_t);
 
-double fp(BUF * buf, int decimals);
-
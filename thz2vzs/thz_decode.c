@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "log.h"
+#include "thz_com.h"
+#include "thz_decode.h"
+
+const struct thz_field thz_fields_timedate[] = {
+	{ 0, 1, 0, 0, "Weekday" },
+	{ 1, 1, 0, 0, "Hour" },
+	{ 2, 1, 0, 0, "Minute" },
+	{ 3, 1, 0, 0, "Second" },
+	{ 4, 1, 0, 0, "Year" },
+	{ 5, 1, 0, 0, "Month" },
+	{ 6, 1, 0, 0, "Day" },
+	{ -1, 0, 0, 0, NULL } // terminator
+};
+
+const struct thz_field thz_fields_hist[] = {
+	{ 0, 2, 0, 0, "compressorHeating" },
+	{ 2, 2, 0, 0, "compressorCooling" },
+	{ 4, 2, 0, 0, "compressorDHW" },
+	{ 6, 2, 0, 0, "boosterDHW" },
+	{ 8, 2, 0, 0, "boosterHeating" },
+	{ -1, 0, 0, 0, NULL } // terminator
+};
+
+const struct thz_field thz_fields_global[] = {
+	{ 0,  2, 0, 1, "collectorTemp" },
+	{ 2,  2, 0, 1, "TAussen" },
+	{ 4,  2, 0, 1, "TVorlauf" },
+	{ 6,  2, 0, 1, "TRuecklauf" },
+	{ 8,  2, 0, 1, "THeissgas" },
+	{ 10, 2, 0, 1, "TWarmwasser" },
+	{ 12, 2, 0, 1, "flowTempHC2" },
+	{ 14, 2, 0, 1, "insideTemp" },
+	{ 16, 2, 0, 1, "TVerdampfer" },
+	{ 18, 2, 0, 1, "TVerfluessig" },
+
+	{ 20, 0, 0, 0, "dhwPump" },
+	{ 20, 0, 1, 0, "heatingCircuitPump" },
+	{ 20, 0, 2, 0, "" },
+	{ 20, 0, 3, 0, "solarPump" },
+	{ 20, 0, 4, 0, "mixerOpen" },
+	{ 20, 0, 5, 0, "mixerClosed" },
+	{ 20, 0, 6, 0, "heatPipeValve" },
+	{ 20, 0, 7, 0, "diverterValve" },
+
+	{ 21, 0, 0, 0, "boosterStage3" },
+	{ 21, 0, 1, 0, "boosterStage2" },
+	{ 21, 0, 2, 0, "boosterStage1" },
+	{ 21, 0, 3, 0, "" },
+	{ 21, 0, 4, 0, "" },
+	{ 21, 0, 5, 0, "" },
+	{ 21, 0, 6, 0, "" },
+	{ 21, 0, 7, 0, "compressor" },
+
+	{ 22, 0, 0, 0, "rvuRelease" },
+	{ 22, 0, 1, 0, "ovenFireplace" },
+	{ 22, 0, 2, 0, "STB" },
+	{ 22, 0, 3, 0, "" },
+	{ 22, 0, 4, 0, "!highPressureSensor" },
+	{ 22, 0, 5, 0, "!lowPressureSensor" },
+	{ 22, 0, 6, 0, "evaporatorIceMonitor" },
+	{ 22, 0, 7, 0, "signalAnode" },
+
+	{ 23, 2, 0, 1, "outputVentilatorPower" },
+	{ 25, 2, 0, 1, "inputVentilatorPower" },
+	{ 27, 2, 0, 1, "mainVentilatorPower" },
+	{ 29, 2, 0, 1, "outputVentilatorSpeed" },
+	{ 31, 2, 0, 1, "inputVentilatorSpeed" },
+	{ 33, 2, 0, 1, "mainVentilatorSpeed"},
+	{ 35, 2, 0, 1, "outside_tempFiltered" },
+	{ 37, 2, 0, 1, "relHumidity" },
+	{ 39, 2, 0, 1, "dewPoint" },
+
+	{ 41, 2, 0, 2, "Niederdruck" },
+	{ 43, 2, 0, 2, "Hochdruck" },
+
+	{ 45, 4, 0, 1, "actualPower_Qc" },
+	{ 49, 4, 0, 1, "actualPower_Pel" },
+	{ 51, 2, 0, 0, NULL },
+	{ 53, 2, 0, 0, NULL },
+	{ 55, 2, 0, 0, NULL },
+	{ 57, 2, 0, 0, NULL },
+	{ 59, 2, 0, 0, NULL },
+	{ 61, 2, 0, 0, NULL },
+	{ 63, 2, 0, 0, NULL },
+	{ 65, 2, 0, 1, "TKuehlung" },
+	{ 67, 2, 0, 1, "TVerdampfAus" },
+	{ 69, 2, 0, 0, NULL },
+	{ 71, 2, 0, 0, NULL },
+	{ 73, 2, 0, 0, NULL },
+	{ 75, 2, 0, 0, NULL },
+	{ -1, 0, 0, 0, NULL } // terminator
+};
+
+const struct thz_field thz_firmware = { 0, 2, 0, 2, "version" };
+
+static const double p10[] = { 1, 10, 100, 1000 };
+
+int thz_field_end(const struct thz_field * f)
+{
+	return f->pos + (f->width ? f->width : 1);
+}
+
+static int table_end(const struct thz_field * f)
+{
+	int end = 0;
+	for (; f->pos >= 0; ++f)
+		if (thz_field_end(f) > end)
+			end = thz_field_end(f);
+	return end;
+}
+
+int thz_reply_min(BUF code)
+{
+	switch (code) {
+	case REQ_GLOBAL: return table_end(thz_fields_global);
+	case REQ_TIMEDATE: return table_end(thz_fields_timedate);
+	case REQ_HIST: return table_end(thz_fields_hist);
+	case REQ_FIRMWARE: return thz_field_end(&thz_firmware);
+	}
+	return 1;
+}
+
+double thz_decode(const BUF * buf, const struct thz_field * f)
+{
+	const BUF * c = buf + f->pos;
+	if (!f->width)
+		return (*c >> f->bit) & 1;
+	unsigned int u = c[0];
+	for (int i=1; i<f->width; ++i)
+		u = u << 8 | c[i];
+	signed int ival = u;
+	if (c[0]&0x80 && f->width < sizeof(signed int))
+		ival -= 1 << (f->width*8); // two's complement
+	return ival / p10[f->digits];
+}
+
+char * thz_rawval(const BUF * buf, const struct thz_field * f)
+{
+	static char out[64];
+	const BUF * c = buf + f->pos;
+	if (f->width) {
+		sprintf(out, "%02hhx", c[0]);
+		for (int i=1; i<f->width; ++i)
+			sprintf(out+i*3-1, " %02hhx", c[i]);
+	} else {
+		for (int i=0; i<8; ++i)
+			out[i] = ((*c << i) & 0x80) ? '1' : '0';
+		sprintf(out+8, "  %02hhx", c[0]);
+	}
+	return out;
+}
+
+/*** decode plan *****************************************************************/
+
+static void * plan_alloc(size_t size)
+{
+	void * p = calloc(1, size);
+	if (p)
+		return p;
+	mylog("malloc %zd bytes failed: %s", size, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static int cmp_pos(const void * a, const void * b)
+{
+	const struct thz_plan_field * fa = a, * fb = b;
+	if (fa->f.pos != fb->f.pos)
+		return fa->f.pos - fb->f.pos;
+	return fa->idx - fb->idx;
+}
+
+struct thz_plan * thz_plan_new(const struct thz_field * fields)
+{
+	struct thz_plan * plan = plan_alloc(sizeof(struct thz_plan));
+	while (fields[plan->n].pos >= 0)
+		++plan->n;
+	plan->field = plan_alloc((plan->n + 1) * sizeof(struct thz_plan_field));
+	plan->byidx = plan_alloc((plan->n + 1) * sizeof(struct thz_plan_field *));
+	for (int i=0; i<plan->n; ++i) {
+		plan->field[i].f = fields[i];
+		plan->field[i].idx = i;
+		if (thz_field_end(&fields[i]) > plan->len)
+			plan->len = thz_field_end(&fields[i]);
+	}
+	// in frame order, so the diff walks the frame once
+	qsort(plan->field, plan->n, sizeof(struct thz_plan_field), cmp_pos);
+	for (int i=0; i<plan->n; ++i)
+		plan->byidx[plan->field[i].idx] = &plan->field[i];
+	return plan;
+}
+
+void thz_plan_free(struct thz_plan * plan)
+{
+	if (!plan)
+		return;
+	free(plan->field);
+	free(plan->byidx);
+	free(plan);
+}
+
+int thz_plan_update(struct thz_plan * plan, const BUF * buf, int len)
+{
+	if (len < 0)
+		len = 0;
+	if (len > sizeof(plan->prev))
+		len = sizeof(plan->prev);
+	// bytes before the first difference are the same for sure
+	int same = len < plan->prevlen ? len : plan->prevlen;
+	int first = 0;
+	while (first < same && buf[first] == plan->prev[first])
+		++first;
+	int changed = 0;
+	for (int i=0; i<plan->n; ++i) {
+		struct thz_plan_field * pf = &plan->field[i];
+		int end = thz_field_end(&pf->f);
+		if (end > len) { // not in this frame
+			pf->valid = 0;
+			continue;
+		}
+		if (pf->valid && end <= same && (end <= first || !memcmp(buf+pf->f.pos, plan->prev+pf->f.pos, end-pf->f.pos)))
+			continue;
+		double val = thz_decode(buf, &pf->f);
+		if (!pf->valid || val != pf->val) {
+			pf->changed = 1;
+			++changed;
+		}
+		pf->val = val;
+		pf->valid = 1;
+	}
+	memcpy(plan->prev, buf, len);
+	plan->prevlen = len;
+	return changed;
+}
+
+double thz_plan_value(const struct thz_plan * plan, int idx)
+{
+	const struct thz_plan_field * pf = plan->byidx[idx];
+	return pf->valid ? pf->val : NAN;
+}
+
+int thz_plan_changed(struct thz_plan * plan, int idx)
+{
+	struct thz_plan_field * pf = plan->byidx[idx];
+	int changed = pf->changed;
+	pf->changed = 0;
+	return changed;
+}
@@ -0,0 +1,52 @@
+// value at an offset of a reply: big endian signed integer of width bytes divided
+// by 10^digits, or a single bit (width 0)
+struct thz_field {
+	int pos;
+	int width; // bytes (1..4), 0 for a bit
+	int bit; // bit number for width 0, 0 is the lsb
+	int digits; // decimals of the fixed-point value (0..3)
+	const char * name;
+};
+
+// field tables of the requests, terminated by pos -1
+extern const struct thz_field thz_fields_global[]; // REQ_GLOBAL
+extern const struct thz_field thz_fields_timedate[]; // REQ_TIMEDATE
+extern const struct thz_field thz_fields_hist[]; // REQ_HIST
+extern const struct thz_field thz_firmware; // REQ_FIRMWARE
+
+// offset after the field
+int thz_field_end(const struct thz_field * f);
+// shortest valid reply to request code: the end of its field table, 1 for other codes
+int thz_reply_min(BUF code);
+double thz_decode(const BUF * buf, const struct thz_field * f);
+// hex (and bits) of the field bytes, static buffer
+char * thz_rawval(const BUF * buf, const struct thz_field * f);
+
+// decode plan: the fields sorted by offset with their last values. each frame is
+// compared with the previous one and only the fields whose bytes changed are decoded
+struct thz_plan_field {
+	struct thz_field f;
+	int idx; // index in the field table
+	double val;
+	unsigned int valid : 1; // val is decoded
+	unsigned int changed : 1; // val changed since thz_plan_changed() was asked
+};
+
+struct thz_plan {
+	int n;
+	int len; // reply length needed for all fields
+	struct thz_plan_field * field; // sorted by pos
+	struct thz_plan_field ** byidx; // field table order
+	BUF prev[1024]; // previous frame
+	int prevlen;
+};
+
+// build the plan for a field table terminated by pos -1. exits if out of memory
+struct thz_plan * thz_plan_new(const struct thz_field * fields);
+void thz_plan_free(struct thz_plan * plan);
+// decode the fields that changed in frame buf, returns their number
+int thz_plan_update(struct thz_plan * plan, const BUF * buf, int len);
+// value of field idx of the table, NAN if it is not in the frames yet
+double thz_plan_value(const struct thz_plan * plan, int idx);
+// whether field idx changed since the last call for it
+int thz_plan_changed(struct thz_plan * plan, int idx);
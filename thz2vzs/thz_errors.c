@@ -4,6 +4,7 @@
 
 #include "log.h"
 #include "thz_com.h"
+#include "thz_decode.h"
 
 #define EPRINT(format, args...) mylog("%s: "format, __FUNCTION__, ##args)
 
@@ -52,7 +53,7 @@ int main(int argc, char * argv[])
 	}
 
 	if (req(0xfd, buf, sizeof(buf)) >= 2)
-		mylog("version: %.2f", fp(buf, 2));
+		mylog("version: %.2f", thz_decode(buf, &thz_firmware));
 
 	do {
 		int got = req(0xd1, buf, sizeof(buf));
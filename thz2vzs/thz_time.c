@@ -6,65 +6,10 @@
 
 #include "log.h"
 #include "thz_com.h"
+#include "thz_decode.h"
 
 #define PROG "set_time"
 
-struct datadef {
-	int pos;
-	int len;
-	int digits;
-	char * name;
-};
-
-const struct datadef thz_time[] = {
-	{ 0, 1, 0, "Weekday" },
-	{ 1, 1, 0, "Hour" },
-	{ 2, 1, 0, "Minute" },
-	{ 3, 1, 0, "Second" },
-	{ 4, 1, 0, "Year" },
-	{ 5, 1, 0, "Month" },
-	{ 6, 1, 0, "Day" },
-	{ -1,  0, 0, NULL } // terminator
-};
-
-const double p10[] = { 1, 10, 100, 1000 };
-
-char * rawval(BUF * buf, const struct datadef * dd) {
-	static char out[64];
-	BUF * c = buf + dd->pos;
-	int len = dd->len;
-	if (len > 0) {
-		sprintf(out, "%02hhx", c[0]);
-		for (int i=1; i<len; ++i)
-			sprintf(out+i*3-1, " %02hhx", c[i]);
-	} else {
-		for (int i=0; i<8; ++i)
-			out[i] = ((*c << i) & 0x80) ? '1' : '0';
-		out[8] = 0;
-		sprintf(out+8, "  %02hhx", c[0]);
-	}	
-	return out;
-}
-
-double conv(BUF * buf, const struct datadef * dd) {
-	BUF * c = buf + dd->pos;
-	int len = dd->len;
-	if (len > 0) {
-		signed int ival = c[0];
-		for (int i=1; i<len; ++i) {
-			ival <<= 8;
-			ival += c[i];
-		}
-		if (c[0]&0x80 && len<sizeof(signed int))
-			ival -= 1 << (len*8); // two's complement
-		double fval = ival;
-		return fval / p10[dd->digits];
-	} else {
-		int shift = - dd->len;
-		return (*c >> shift) & 1;
-	}
-}
-
 int main(int argc, char * argv[])
 {
 	if (argc < 2) {
@@ -92,7 +37,7 @@ int main(int argc, char * argv[])
 	}
 
 	if (req(REQ_FIRMWARE, buf, sizeof(buf)) >= 2)
-		mylog("version: %.2f", fp(buf, 2));
+		mylog("version: %.2f", thz_decode(buf, &thz_firmware));
 
 	int got;
 
@@ -100,11 +45,11 @@ int main(int argc, char * argv[])
 	dump("datetime", buf, got);
 	if (got == 7) {
 #if 0
-		for (const struct datadef * dd=thz_time; dd->pos >= 0; ++dd) {
-			if (dd->pos+dd->len > got)
+		for (const struct thz_field * f=thz_fields_timedate; f->pos >= 0; ++f) {
+			if (thz_field_end(f) > got)
 				continue;
-			double val = conv(buf, dd);
-			mylog("Offset %2d (%s): %.*f (%s)", dd->pos, dd->name?dd->name:"", dd->digits, val, rawval(buf, dd));
+			double val = thz_decode(buf, f);
+			mylog("Offset %2d (%s): %.*f (%s)", f->pos, f->name?f->name:"", f->digits, val, thz_rawval(buf, f));
 		}
 #endif
 		mylog("thz_time: %02hhd.%02hhd.%02hhd %02hhd:%02hhd:%02hhd (day %d)", buf[6], buf[5], buf[4], buf[1], buf[2], buf[3], buf[0]);	